@@ -0,0 +1,4119 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE //MAP_ANONYMOUS
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <error.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "lispy.h"
+
+char *strdup(const char *s);
+
+/* first member of every heap object, see the collector below */
+enum {LGC_USED = 1, LGC_MARK = 2, LGC_ENV = 4, LGC_ARENA = 8,
+      LGC_RESOLVED = 16, //a lambda body, see lval_resolve
+      LGC_CONST = 32,    //a call of its code on constants, see lnode_fold
+      LGC_JIT = 64,      //a body with an entry in the JIT table, see ljit_call
+      LGC_NOJIT = 128};  //a body the JIT can't compile
+
+struct lenv {
+    unsigned char gc;
+    unsigned char level; //arena level, 0 for the heap
+    lenv* par;
+    int count;
+    int cap;
+    char** syms; //interned, see lval_sym
+    lval** vals;
+    int* index;    //hash of syms to slots, NULL for small envs, see lenv_find
+    int index_cap; //power of 2
+    lenv* fwd;     //promoted arena env: the heap copy standing for it
+    int loop;      //the frame of a loop, see buildin_loop
+};
+
+/*
+ * Slab allocator for the fixed size objects (lval, lenv).
+ *
+ * Objects are carved out of slabs of LSLAB_OBJS and recycled through a
+ * free list, slabs are never given back to the system. Every thread has
+ * its own pools, so the fast path needs no locking: an object freed by
+ * another thread simply moves to that thread's free list.
+ */
+#define LSLAB_OBJS 256
+
+enum {LPOOL_LVAL, LPOOL_LENV, LPOOL_MAX};
+
+typedef struct lfree lfree;
+struct lfree {
+    unsigned char gc; //0: on the free list
+    unsigned char level;
+    lfree* next;
+};
+
+typedef struct lslab lslab;
+struct lslab {
+    lslab* next;
+    //followed by LSLAB_OBJS objects
+};
+
+typedef struct lpool {
+    const char* name;
+    size_t size;
+    lfree* free;
+    lslab* slab;
+    long live;  //objects in use
+    long slabs; //slabs allocated
+} lpool;
+
+static __thread lpool lpools[LPOOL_MAX] = {
+    [LPOOL_LVAL] = {"lval", sizeof(lval)},
+    [LPOOL_LENV] = {"lenv", sizeof(lenv)},
+};
+
+static __thread long lpool_allocated; //objects ever allocated
+static __thread unsigned char lgc_black; //mark bit of live objects
+
+static inline char* lslab_obj(lpool* p, lslab* s, int i)
+{
+    return (char*)(s+1) + i*p->size;
+}
+
+static void lpool_grow(lpool* p)
+{
+    lslab* s = malloc(sizeof(lslab) + p->size * LSLAB_OBJS);
+    s->next = p->slab;
+    p->slab = s;
+    for (int i=LSLAB_OBJS-1; i>=0; i--)
+    {
+        lfree* x = (lfree*)lslab_obj(p, s, i);
+        x->gc = 0;
+        x->next = p->free;
+        p->free = x;
+    }
+    p->slabs++;
+}
+
+void* lpool_alloc(int kind)
+{
+    lpool* p = &lpools[kind];
+    if (!p->free)
+        lpool_grow(p);
+
+    lfree* x = p->free;
+    p->free = x->next;
+    p->live++;
+    lpool_allocated++;
+    x->gc = LGC_USED | (kind == LPOOL_LENV ? LGC_ENV : 0) | lgc_black;
+    x->level = 0;
+    return x;
+}
+
+void lpool_free(int kind, void* x)
+{
+    lpool* p = &lpools[kind];
+    ((lfree*)x)->gc = 0;
+    ((lfree*)x)->next = p->free;
+    p->free = x;
+    p->live--;
+}
+
+typedef struct lpool_stat {
+    const char* name;
+    long live;        //objects in use
+    long live_bytes;
+    long slab_bytes;  //reserved by the slabs, used or not
+} lpool_stat;
+
+/* stats of the calling thread's pools, out must hold LPOOL_MAX entries */
+void lpool_stats(lpool_stat* out)
+{
+    for (int i=0; i<LPOOL_MAX; i++)
+    {
+        lpool* p = &lpools[i];
+        out[i].name = p->name;
+        out[i].live = p->live;
+        out[i].live_bytes = p->live * p->size;
+        out[i].slab_bytes = p->slabs * LSLAB_OBJS * p->size;
+    }
+}
+
+/*
+ * Mark-sweep garbage collector.
+ *
+ * Values are immutable once built and shared freely, nobody owns them.
+ * A collection marks everything reachable from the roots and then sweeps
+ * the slabs, freeing whatever was not marked, cycles included.
+ *
+ * The roots are the root stacks: the global env is pushed once, and
+ * lval_eval pushes the env and expression it is working on. Collections
+ * only happen at the start of lval_eval, so C code that holds values
+ * across a call to lval_eval must push them, other code needn't bother.
+ *
+ * In incremental mode a cycle is split into steps of at most budget_us
+ * microseconds, run every LGC_STEP_ALLOC allocations, unless the heap
+ * grows by LGC_MAX_GROWTH times the threshold meanwhile. It is the usual
+ * tri-color scheme: an object is black when its mark bit equals
+ * lgc_black, gray while it also sits on the gray stack, white otherwise.
+ * The meaning of the bit flips at every cycle, so the sweep never has to
+ * clear it, and new objects are born black. The write barrier
+ * (lgc_barrier, see lgc_store) grays a white object stored into the heap
+ * while marking;
+ * the root stacks aren't barriered, they are scanned again at the end of
+ * the mark phase.
+ */
+#define LGC_MIN_THRESHOLD 4096
+#define LGC_STEP_ALLOC 1024
+#define LGC_MAX_GROWTH 4
+#define LGC_PAUSE_BUCKETS 20 //log2 of microseconds
+
+enum {LGC_IDLE, LGC_MARKING, LGC_SWEEPING};
+
+typedef struct lstack {
+    void** items;
+    int count;
+    int cap;
+} lstack;
+
+typedef struct lgc {
+    lstack vals;  //root values
+    lstack envs;  //root environments
+    lstack gray;  //marked, children not yet marked
+
+    int incremental;
+    long budget_us;  //pause budget of an incremental step
+    int phase;
+    int sweep_pool;
+    lslab* sweep_slab;
+    long alloc_cycle; //lpool_allocated at the end of the last cycle
+    long alloc_step;  //lpool_allocated at the last step
+
+    long threshold;
+    long cycles;
+    long freed;
+    long live;
+
+    long pauses[LGC_PAUSE_BUCKETS];
+    long pause_count;
+    long pause_total_us;
+    long pause_max_us;
+} lgc;
+
+static __thread lgc gc = {
+    .budget_us = 1000,
+    .threshold = LGC_MIN_THRESHOLD,
+};
+
+static inline void lstack_push(lstack* s, void* x)
+{
+    if (s->count == s->cap)
+    {
+        s->cap = s->cap ? s->cap*2 : 64;
+        s->items = realloc(s->items, s->cap * sizeof(void*));
+    }
+    s->items[s->count++] = x;
+}
+
+void lgc_push_val(lval* v)
+{
+    lstack_push(&gc.vals, v);
+}
+
+void lgc_pop_vals(int n)
+{
+    gc.vals.count -= n;
+}
+
+void lgc_push_env(lenv* e)
+{
+    lstack_push(&gc.envs, e);
+}
+
+void lgc_pop_envs(int n)
+{
+    gc.envs.count -= n;
+}
+
+static inline void lgc_mark(void* x)
+{
+    if (!x || lval_is_fixnum(x))
+        return;
+    unsigned char* flags = x;
+    if ((*flags & LGC_MARK) == lgc_black)
+        return;
+    *flags ^= LGC_MARK;
+    lstack_push(&gc.gray, x);
+}
+
+/* x is being stored into a heap object */
+static inline void lgc_barrier(void* x)
+{
+    if (gc.phase == LGC_MARKING)
+        lgc_mark(x);
+}
+
+static void lnode_trace(lval* v);
+static void lgc_trace(void* x)
+{
+    if (*(unsigned char*)x & LGC_ENV)
+    {
+        lenv* e = x;
+        lgc_mark(e->par);
+        lgc_mark(e->fwd);
+        for (int i=0; i<e->count; i++)
+            lgc_mark(e->vals[i]);
+        return;
+    }
+
+    lval* v = x;
+    switch (v->type)
+    {
+    case LVAL_FUN:
+        if (!v->buildin)
+        {
+            lgc_mark(v->env);
+            lgc_mark(v->formals);
+            lgc_mark(v->body);
+        }
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_BUF:
+        if (v->base)
+        {
+            lgc_mark(v->base);
+            break;
+        }
+        for (int i=0; i<v->count; i++)
+            lgc_mark(v->cell[i]);
+        if (v->type == LVAL_SEXPR)
+            lnode_trace(v);
+        break;
+    }
+}
+
+static void lvm_free(lcode* c);
+static void ljit_forget(lval* body);
+static void lgc_finalize(void* x)
+{
+    if (*(unsigned char*)x & LGC_ENV)
+    {
+        lenv* e = x;
+        free(e->syms);
+        free(e->vals);
+        free(e->index);
+        lpool_free(LPOOL_LENV, e);
+        return;
+    }
+
+    lval* v = x;
+    switch (v->type)
+    {
+    case LVAL_ERR: free(v->err); break;
+    case LVAL_STR: free(v->str); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_BUF:
+        if (!v->base)
+            free(v->cell);
+        lvm_free(v->code);
+        if (v->gc & LGC_JIT)
+            ljit_forget(v);
+        break;
+    }
+    lpool_free(LPOOL_LVAL, v);
+}
+
+static void larena_mark_memo(void);
+static void lkont_mark(void);
+static void lgc_mark_roots(void)
+{
+    larena_mark_memo();
+    lkont_mark();
+    for (int i=0; i<gc.envs.count; i++)
+        lgc_mark(gc.envs.items[i]);
+    for (int i=0; i<gc.vals.count; i++)
+        lgc_mark(gc.vals.items[i]);
+}
+
+static void lgc_begin(void)
+{
+    lgc_black ^= LGC_MARK; //everything turns white
+    gc.phase = LGC_MARKING;
+    gc.live = 0;
+    lgc_mark_roots();
+}
+
+/* returns the number of objects looked at */
+static long lgc_sweep_slab(void)
+{
+    while (!gc.sweep_slab)
+    {
+        if (++gc.sweep_pool == LPOOL_MAX)
+            return 0;
+        gc.sweep_slab = lpools[gc.sweep_pool].slab;
+    }
+
+    lpool* p = &lpools[gc.sweep_pool];
+    lslab* s = gc.sweep_slab;
+    for (int i=0; i<LSLAB_OBJS; i++)
+    {
+        unsigned char* flags = (unsigned char*)lslab_obj(p, s, i);
+        if (!(*flags & LGC_USED))
+            continue;
+        if ((*flags & LGC_MARK) == lgc_black)
+            gc.live++;
+        else
+        {
+            lgc_finalize(flags);
+            gc.freed++;
+        }
+    }
+    gc.sweep_slab = s->next;
+    return LSLAB_OBJS;
+}
+
+static void lgc_end(void)
+{
+    gc.phase = LGC_IDLE;
+    gc.cycles++;
+    gc.threshold = gc.live > LGC_MIN_THRESHOLD ? gc.live : LGC_MIN_THRESHOLD;
+    gc.alloc_cycle = lpool_allocated;
+}
+
+static long lgc_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void lgc_record_pause(long us)
+{
+    int b = 0;
+    while (b < LGC_PAUSE_BUCKETS-1 && (1L << b) <= us)
+        b++;
+    gc.pauses[b]++;
+    gc.pause_count++;
+    gc.pause_total_us += us;
+    if (us > gc.pause_max_us)
+        gc.pause_max_us = us;
+}
+
+/*
+ * Collect until budget_us is used up, or for the whole cycle when
+ * budget_us < 0.
+ */
+static void lgc_step(long budget_us)
+{
+    long start = lgc_now_us();
+    long work = 0, check = 0;
+    if (gc.phase == LGC_IDLE)
+        lgc_begin();
+    while (gc.phase != LGC_IDLE)
+    {
+        if (gc.phase == LGC_MARKING)
+        {
+            if (gc.gray.count)
+            {
+                lgc_trace(gc.gray.items[--gc.gray.count]);
+                work++;
+            }
+            else
+            {
+                //the roots weren't barriered, finish marking atomically
+                lgc_mark_roots();
+                while (gc.gray.count)
+                    lgc_trace(gc.gray.items[--gc.gray.count]);
+                gc.phase = LGC_SWEEPING;
+                gc.sweep_pool = 0;
+                gc.sweep_slab = lpools[0].slab;
+            }
+        }
+        else
+        {
+            long n = lgc_sweep_slab();
+            if (!n)
+                lgc_end();
+            work += n;
+        }
+
+        if (budget_us >= 0 && work >= check)
+        {
+            if (lgc_now_us() - start >= budget_us)
+                break;
+            check = work + 64;
+        }
+    }
+    gc.alloc_step = lpool_allocated;
+    lgc_record_pause(lgc_now_us() - start);
+}
+
+/* a full stop-the-world collection, or the rest of the current cycle */
+void lgc_collect(void)
+{
+    lgc_step(-1);
+}
+
+static inline void lgc_safepoint(void)
+{
+#ifdef LGC_STRESS
+    lgc_step(gc.incremental ? 0 : -1);
+    return;
+#endif
+    if (gc.phase != LGC_IDLE)
+    {
+        //the steps don't keep up with the allocation, finish the cycle
+        if (lpool_allocated - gc.alloc_cycle >= LGC_MAX_GROWTH * gc.threshold)
+            lgc_collect();
+        else if (lpool_allocated - gc.alloc_step >= LGC_STEP_ALLOC)
+            lgc_step(gc.budget_us);
+    }
+    else if (lpool_allocated - gc.alloc_cycle >= gc.threshold)
+        lgc_step(gc.incremental ? gc.budget_us : -1);
+}
+
+/*
+ * Arena of a top-level form.
+ *
+ * Most values built while evaluating a REPL line, or a form of a loaded
+ * file, are dead once its result is printed. larena_begin/larena_end
+ * bracket such a form: in between lval_alloc/lenv_alloc bump allocate
+ * from the arena, and larena_end drops all of it at once by resetting
+ * the pointer. A file loaded from a form nests one level per form.
+ *
+ * The collector marks through the arena but never sweeps it, so arena
+ * objects may point anywhere. The other way round is forbidden: a value
+ * stored into a heap object, or into an arena object of an older level,
+ * is first promoted to the heap by lgc_store. After LARENA_LIMIT bytes
+ * the rest of the form allocates from the heap again, so that a long
+ * running form still has its garbage collected.
+ */
+#define LARENA_CHUNK (256*1024)
+#ifndef LARENA_LIMIT
+#define LARENA_LIMIT (16*1024*1024)
+#endif
+#define LARENA_LEVELS 64
+#define LARENA_SPARES 4
+
+typedef struct lchunk lchunk;
+struct lchunk {
+    lchunk* next; //the older chunks
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+typedef struct larena_mark {
+    lchunk* chunk;
+    size_t used;
+    size_t bytes;
+} larena_mark;
+
+typedef struct larena {
+    lchunk* chunk; //the newest chunk
+    lchunk* spare; //released chunks kept for reuse
+    int spares;
+    int depth;     //forms being run, 0: allocate from the heap
+    int level;     //level of new objects, depth capped to LARENA_LEVELS-1
+    larena_mark marks[LARENA_LEVELS];
+    size_t bytes;  //allocated by the running forms
+
+    //arena object -> heap copy, for the running forms
+    void** memo;   //pairs
+    int memo_count;
+    int memo_cap;
+
+    long resets;
+    long promoted;
+} larena;
+
+static __thread larena arena;
+
+static void* larena_alloc(size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    lchunk* c = arena.chunk;
+    if (!c || c->used + size > c->size)
+    {
+        size_t n = size > LARENA_CHUNK ? size : LARENA_CHUNK;
+        if (arena.spare && arena.spare->size >= n)
+        {
+            c = arena.spare;
+            arena.spare = c->next;
+            arena.spares--;
+        }
+        else
+        {
+            c = malloc(sizeof(lchunk) + n);
+            c->size = n;
+        }
+        c->used = 0;
+        c->next = arena.chunk;
+        arena.chunk = c;
+    }
+
+    void* x = c->data + c->used;
+    c->used += size;
+    arena.bytes += size;
+    return x;
+}
+
+static inline int larena_active(void)
+{
+    return arena.level && arena.bytes < LARENA_LIMIT;
+}
+
+static inline int larena_has(void* x)
+{
+    return *(unsigned char*)x & LGC_ARENA;
+}
+
+static inline int larena_level(void* x)
+{
+    return ((unsigned char*)x)[1];
+}
+
+static inline size_t larena_hash(void* x)
+{
+    return ((uintptr_t)x >> 3) * 2654435761u;
+}
+
+static void* larena_memo_get(void* x)
+{
+    if (!arena.memo_count)
+        return NULL;
+    size_t mask = arena.memo_cap - 1;
+    for (size_t i = larena_hash(x) & mask; arena.memo[2*i]; i = (i+1) & mask)
+        if (arena.memo[2*i] == x)
+            return arena.memo[2*i+1];
+    return NULL;
+}
+
+static void larena_memo_put(void* x, void* copy)
+{
+    if (2*(arena.memo_count+1) > arena.memo_cap)
+    {
+        void** old = arena.memo;
+        int old_cap = arena.memo_cap;
+        arena.memo_cap = old_cap ? old_cap*2 : 64;
+        arena.memo = calloc(2*arena.memo_cap, sizeof(void*));
+        arena.memo_count = 0;
+        for (int i=0; i<old_cap; i++)
+            if (old[2*i] && old[2*i+1])
+                larena_memo_put(old[2*i], old[2*i+1]);
+        free(old);
+    }
+
+    size_t mask = arena.memo_cap - 1;
+    size_t i = larena_hash(x) & mask;
+    while (arena.memo[2*i])
+        i = (i+1) & mask;
+    arena.memo[2*i] = x;
+    arena.memo[2*i+1] = copy;
+    arena.memo_count++;
+}
+
+/* forget the copies of the objects of level and above, they are dropped */
+static void larena_memo_drop(int level)
+{
+    int n = 0;
+    for (int i=0; i<arena.memo_cap; i++)
+    {
+        void** x = &arena.memo[2*i];
+        if (x[0] && larena_level(x[0]) < level)
+        {
+            arena.memo[2*n] = x[0];  //compact the survivors to the front
+            arena.memo[2*n+1] = x[1];
+            n++;
+        }
+    }
+    for (int i=n; i<arena.memo_cap; i++)
+        arena.memo[2*i] = NULL;
+
+    //and hash them again
+    void** old = malloc(2*n*sizeof(void*));
+    memcpy(old, arena.memo, 2*n*sizeof(void*));
+    memset(arena.memo, 0, 2*arena.memo_cap*sizeof(void*));
+    arena.memo_count = 0;
+    for (int i=0; i<n; i++)
+        larena_memo_put(old[2*i], old[2*i+1]);
+    free(old);
+}
+
+void larena_begin(void)
+{
+    if (++arena.depth >= LARENA_LEVELS)
+        return;
+
+    larena_mark* m = &arena.marks[arena.depth];
+    m->chunk = arena.chunk;
+    m->used = arena.chunk ? arena.chunk->used : 0;
+    m->bytes = arena.bytes;
+    arena.level = arena.depth;
+}
+
+void larena_end(void)
+{
+    if (arena.depth-- >= LARENA_LEVELS)
+        return;
+
+    //the collector may still have the dropped objects on its gray stack
+    int n = 0;
+    for (int i=0; i<gc.gray.count; i++)
+    {
+        void* x = gc.gray.items[i];
+        if (!larena_has(x) || larena_level(x) < arena.level)
+            gc.gray.items[n++] = x;
+    }
+    gc.gray.count = n;
+
+    if (arena.memo_count)
+        larena_memo_drop(arena.level);
+
+    larena_mark* m = &arena.marks[arena.level];
+    while (arena.chunk != m->chunk)
+    {
+        lchunk* c = arena.chunk;
+        arena.chunk = c->next;
+        if (arena.spares < LARENA_SPARES && c->size == LARENA_CHUNK)
+        {
+            c->next = arena.spare;
+            arena.spare = c;
+            arena.spares++;
+        }
+        else
+            free(c);
+    }
+    if (arena.chunk)
+        arena.chunk->used = m->used;
+    arena.bytes = m->bytes;
+    arena.level = arena.depth;
+    arena.resets++;
+}
+
+/* the heap copies are reused for the rest of the form */
+static void larena_mark_memo(void)
+{
+    for (int i=0; arena.memo_count && i<arena.memo_cap; i++)
+        if (arena.memo[2*i])
+            lgc_mark(arena.memo[2*i+1]);
+}
+
+lval* lval_promote(lval* v);
+lenv* lenv_promote(lenv* e);
+
+/* x escapes if it is younger than owner, which is going to point to it */
+static inline int larena_escapes(void* owner, void* x)
+{
+    return x && !lval_is_fixnum(x) && larena_has(x)
+        && (!larena_has(owner) || larena_level(owner) < larena_level(x));
+}
+
+/* x is being stored into owner */
+static inline lval* lgc_store(void* owner, lval* x)
+{
+    if (larena_escapes(owner, x))
+        x = lval_promote(x);
+    lgc_barrier(x);
+    return x;
+}
+
+static inline lenv* lgc_store_env(void* owner, lenv* e)
+{
+    if (larena_escapes(owner, e))
+        e = lenv_promote(e);
+    lgc_barrier(e);
+    return e;
+}
+
+lval* lval_alloc(void)
+{
+    if (!larena_active())
+        return lpool_alloc(LPOOL_LVAL);
+
+    lval* x = larena_alloc(sizeof(lval));
+    x->gc = LGC_USED | LGC_ARENA | lgc_black;
+    x->level = arena.level;
+    return x;
+}
+
+lenv* lenv_alloc(void)
+{
+    if (!larena_active())
+        return lpool_alloc(LPOOL_LENV);
+
+    lenv* e = larena_alloc(sizeof(lenv));
+    e->gc = LGC_USED | LGC_ARENA | LGC_ENV | lgc_black;
+    e->level = arena.level;
+    return e;
+}
+
+/* memory owned by the object owner: strings, cells, ... */
+static void* lgc_mem(void* owner, size_t size)
+{
+    return larena_has(owner) ? larena_alloc(size) : malloc(size);
+}
+
+static char* lgc_strdup(void* owner, const char* s)
+{
+    size_t n = strlen(s) + 1;
+    return memcpy(lgc_mem(owner, n), s, n);
+}
+
+/* the next capacity of an array of cap items which needs n */
+static inline int lgc_cap(int cap, int n)
+{
+    cap = cap ? 2*cap : 4;
+    return cap > n ? cap : n;
+}
+
+/*
+ * Resize the array of owner, which holds count items, to cap items. The
+ * old array of an arena object is left to the arena.
+ */
+static void* lgc_realloc(void* owner, void* items, int count, int cap, size_t size)
+{
+    if (!larena_has(owner))
+        return realloc(items, cap * size);
+
+    void* x = larena_alloc(cap * size);
+    if (count)
+        memcpy(x, items, count * size);
+    return x;
+}
+
+char* ltype_name(int type)
+{
+#define LVAL_TPYE(type)  \
+    case type: return #type;
+
+    switch (type)
+    {
+    LVAL_TPYE(LVAL_ERR);
+    LVAL_TPYE(LVAL_NUM);
+    LVAL_TPYE(LVAL_SYM);
+    LVAL_TPYE(LVAL_STR);
+    LVAL_TPYE(LVAL_FUN);
+    LVAL_TPYE(LVAL_SEXPR);
+    LVAL_TPYE(LVAL_QEXPR);
+    LVAL_TPYE(LVAL_BUF);
+    default: return "Unknown";
+    }
+
+}
+
+lval* lval_err(char* fmt, ...)
+{
+    lval *x = lval_alloc();
+    x->type = LVAL_ERR;
+    char err[512];
+
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(err, 511, fmt, va);
+    va_end(va);
+
+    x->err = lgc_strdup(x, err);
+
+    return x;
+}
+
+lval* lval_num(long n)
+{
+    if (n >= LVAL_FIXNUM_MIN && n <= LVAL_FIXNUM_MAX)
+        return (lval*)(((uintptr_t)n << 1) | 1);
+
+    lval* x = lval_alloc();
+    x->type = LVAL_NUM;
+    x->num = n;
+    return x;
+}
+
+/*
+ * Symbol table: every symbol name is interned once, together with its
+ * symbol lval, so symbols and their names compare by pointer. They are
+ * never freed, and live outside the slabs and arenas.
+ */
+typedef struct lsymtab {
+    lval** syms;
+    int count;
+    int cap; //power of 2
+} lsymtab;
+
+static __thread lsymtab symtab;
+
+static size_t lsym_hash(const char* s)
+{
+    size_t h = 2166136261u;
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static void lsym_insert(lval* x)
+{
+    size_t mask = symtab.cap - 1;
+    size_t i = lsym_hash(x->sym) & mask;
+    while (symtab.syms[i])
+        i = (i+1) & mask;
+    symtab.syms[i] = x;
+}
+
+//the slot of an interned symbol when it isn't a global one, see lenv_get
+#define LSYM_UNCACHED -1
+#define LSYM_LOCAL -2
+
+lval* lval_sym(char* str)
+{
+    if (symtab.cap)
+    {
+        size_t mask = symtab.cap - 1;
+        for (size_t i = lsym_hash(str) & mask; symtab.syms[i]; i = (i+1) & mask)
+            if (!strcmp(symtab.syms[i]->sym, str))
+                return symtab.syms[i];
+    }
+
+    if (2*(symtab.count+1) > symtab.cap)
+    {
+        lval** old = symtab.syms;
+        int old_cap = symtab.cap;
+        symtab.cap = old_cap ? old_cap*2 : 256;
+        symtab.syms = calloc(symtab.cap, sizeof(lval*));
+        for (int i=0; i<old_cap; i++)
+            if (old[i])
+                lsym_insert(old[i]);
+        free(old);
+    }
+
+    lval* x = malloc(sizeof(lval));
+    x->gc = LGC_USED;
+    x->level = 0;
+    x->type = LVAL_SYM;
+    x->sym = strdup(str);
+    x->depth = -1;
+    x->slot = LSYM_UNCACHED;
+    lsym_insert(x);
+    symtab.count++;
+    return x;
+}
+
+/* a symbol bound in the frame depth levels up, at slot */
+lval* lval_ref(char* sym, int depth, int slot)
+{
+    lval* x = lval_alloc();
+    x->type = LVAL_SYM;
+    x->sym = sym;
+    x->depth = depth;
+    x->slot = slot;
+    return x;
+}
+
+lval* lval_str(char* str)
+{
+    lval* x = lval_alloc();
+    x->type = LVAL_STR;
+    x->str = lgc_strdup(x, str);
+    return x;
+}
+
+lval* lval_buidin(lbuildin func)
+{
+    lval* x = lval_alloc();
+    x->type = LVAL_FUN;
+    x->buildin = func;
+    x->form = 0;
+    return x;
+}
+
+/* a lambda closing over env, its frames chain to it */
+lval* lval_lambda(lenv* env, lval* formals, lval* body)
+{
+    lval* x = lval_alloc();
+    x->type = LVAL_FUN;
+    x->buildin = NULL;
+    x->env = lgc_store_env(x, env);
+    x->formals = lgc_store(x, formals);
+    x->body = lgc_store(x, body);
+
+    return x;
+}
+
+lval* lval_expr(int type)
+{
+    lval* x = lval_alloc();
+    x->type = type;
+    x->count = 0;
+    x->cap = 0;
+    x->cell = NULL;
+    x->base = NULL;
+    x->code = NULL;
+    return x;
+}
+
+lval* lval_sexpr(void)
+{
+    return lval_expr(LVAL_SEXPR);
+}
+
+lval* lval_qexpr(void)
+{
+    return lval_expr(LVAL_QEXPR);
+}
+
+/* make room for n cells in v, a view gets its own copy of the cells */
+void lval_reserve(lval* v, int n)
+{
+    if (n <= v->cap)
+        return;
+    int cap = lgc_cap(v->cap, n);
+    if (v->base)
+    {
+        lval** cell = lgc_mem(v, cap * sizeof(lval*));
+        memcpy(cell, v->cell, v->count * sizeof(lval*));
+        v->cell = cell;
+        v->base = NULL;
+    }
+    else
+        v->cell = lgc_realloc(v, v->cell, v->count, cap, sizeof(lval*));
+    v->cap = cap;
+}
+
+lval* lval_add(lval* v, lval* x)
+{
+    if (v->count == v->cap)
+        lval_reserve(v, v->count+1);
+    v->cell[v->count++] = lgc_store(v, x);
+    return v;
+}
+
+/* add the n values of items to v */
+lval* lval_append(lval* v, lval** items, int n)
+{
+    lval_reserve(v, v->count+n);
+    for (int i=0; i<n; i++)
+        v->cell[v->count++] = lgc_store(v, items[i]);
+    return v;
+}
+
+/* a new expr of type with the cells [start, end) of v */
+lval* lval_slice(int type, lval* v, int start, int end)
+{
+    lval* x = lval_expr(type);
+    return lval_append(x, v->cell+start, end-start);
+}
+
+/*
+ * Views: an expr whose cells are a range of the cells of another one,
+ * its base, so that tail and copies are O(1). The cells of a value are
+ * never changed once it is built, except those of a buffer (LVAL_BUF)
+ * past the views of it: join appends there in place when its first list
+ * ends where the buffer does, which makes building a list by joining
+ * linear. The base keeps all of its cells alive.
+ */
+lval* lval_view(int type, lval* v, int start, int end)
+{
+    lval* x = lval_expr(type);
+    if (start == end)
+        return x;
+
+    lval* b = v->base ? v->base : v;
+    int off = (v->cell - b->cell) + start;
+    x->base = lgc_store(x, b);
+    x->cell = x->base->cell + off;
+    x->count = end - start;
+    return x;
+}
+
+/* the object holding the cells of v, for the stores into them */
+static inline lval* lval_owner(lval* v)
+{
+    return v->base ? v->base : v;
+}
+
+lenv* lenv_new(void)
+{
+    lenv* e = lenv_alloc();
+    e->par = NULL;
+    e->count = 0;
+    e->cap = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    e->index = NULL;
+    e->index_cap = 0;
+    e->fwd = NULL;
+    e->loop = 0;
+    return e;
+}
+
+/*
+ * The env standing for e. A promoted env keeps its identity: the code
+ * still running in the arena original reads and writes the heap copy,
+ * which the escaped closures share, see lenv_promote.
+ */
+static inline lenv* lenv_fwd(lenv* e)
+{
+    return e && e->fwd ? e->fwd : e;
+}
+
+/* the frame of a call, with room for n arguments, in par */
+lenv* lenv_frame(lenv* par, int n)
+{
+    lenv* e = lenv_new();
+    e->par = lgc_store_env(e, lenv_fwd(par));
+    e->cap = n;
+    e->syms = lgc_mem(e, n*sizeof(char*));
+    e->vals = lgc_mem(e, n*sizeof(lval*));
+    return e;
+}
+
+/*
+ * Environments of more than LENV_HASH_MIN bindings, the global one in
+ * practice, get an open addressing index of their slots keyed by the
+ * interned name. The slots stay in syms/vals, in definition order.
+ */
+#define LENV_HASH_MIN 16
+
+static void lenv_index_insert(lenv* e, int slot)
+{
+    size_t mask = e->index_cap - 1;
+    size_t i = larena_hash(e->syms[slot]) & mask;
+    while (e->index[i] >= 0)
+        i = (i+1) & mask;
+    e->index[i] = slot;
+}
+
+/* (re)build the index, with a load factor of at most 1/2 */
+static void lenv_index(lenv* e)
+{
+    int cap = 64;
+    while (cap < 4*e->count)
+        cap *= 2;
+    if (!larena_has(e))
+        free(e->index);
+    e->index = lgc_mem(e, cap*sizeof(int));
+    e->index_cap = cap;
+    memset(e->index, -1, cap*sizeof(int));
+    for (int i=0; i<e->count; i++)
+        lenv_index_insert(e, i);
+}
+
+/* the slot of sym in e, -1 if it isn't bound there */
+static int lenv_find(lenv* e, char* sym)
+{
+    if (e->index)
+    {
+        size_t mask = e->index_cap - 1;
+        for (size_t i = larena_hash(sym) & mask; e->index[i] >= 0; i = (i+1) & mask)
+            if (e->syms[e->index[i]] == sym)
+                return e->index[i];
+        return -1;
+    }
+    for (int i=0; i<e->count; i++)
+        if (e->syms[i] == sym)
+            return i;
+    return -1;
+}
+
+/* the index of x is a copy of the one of e */
+static void lenv_copy_index(lenv* x, lenv* e)
+{
+    x->index = NULL;
+    x->index_cap = e->index_cap;
+    if (e->index)
+        x->index = memcpy(lgc_mem(x, e->index_cap*sizeof(int)), e->index,
+                          e->index_cap*sizeof(int));
+}
+
+/*
+ * The binding of the lexical address of k, NULL when the frames don't
+ * match it. The frames in between are searched, they hold a handful of
+ * formals at most.
+ */
+static lval** lenv_slot(lenv* e, char* sym, int depth, int slot)
+{
+    e = lenv_fwd(e);
+    for (int d = depth; d > 0; d--, e = lenv_fwd(e->par))
+        if (!e || lenv_find(e, sym) >= 0)
+            return NULL;
+    if (e && slot < e->count && e->syms[slot] == sym)
+        return &e->vals[slot];
+    return NULL;
+}
+
+/*
+ * Global bindings are cached in the interned symbol: the slot of its name
+ * in lenv_globals, so that a global (a called function mostly) is found
+ * with one check instead of a search of each frame and of the index. The
+ * slots of the global env never move and def stores into them, so the
+ * cache only goes stale when some frame binds the name: it is then marked
+ * LSYM_LOCAL for good and looked up by name.
+ */
+static lenv* lenv_globals;
+
+/* k is just the name of val, to find the value of the val in the env */
+lval* lenv_get(lenv* e, lval* k)
+{
+    if (k->depth >= 0)
+    {
+        lval** x = lenv_slot(e, k->sym, k->depth, k->slot);
+        if (x)
+            return *x;
+    }
+    else if (k->slot >= 0 && k->slot < lenv_globals->count
+             && lenv_globals->syms[k->slot] == k->sym)
+        return lenv_globals->vals[k->slot];
+
+    for (e = lenv_fwd(e); e; e = lenv_fwd(e->par))
+    {
+        int i = lenv_find(e, k->sym);
+        if (i >= 0)
+        {
+            if (e == lenv_globals && k->depth < 0 && k->slot != LSYM_LOCAL)
+                k->slot = i;
+            return e->vals[i];
+        }
+    }
+    return lval_err("unbounded symbol %s", k->sym);
+}
+
+/* k is just the name of val, v is the value of the val*/
+void lenv_put(lenv* e, lval* k, lval* v)
+{
+    //a reference is to a formal, which is bound before it is run
+    if (e != lenv_globals && k->depth < 0)
+        k->slot = LSYM_LOCAL;
+
+    e = lenv_fwd(e);
+    int i = lenv_find(e, k->sym);
+    if (i >= 0)
+    {
+        e->vals[i] = lgc_store(e, v);
+        return ;
+    }
+
+    if (e->count == e->cap)
+    {
+        int cap = lgc_cap(e->cap, e->count+1);
+        e->syms = lgc_realloc(e, e->syms, e->count, cap, sizeof(e->syms[0]));
+        e->vals = lgc_realloc(e, e->vals, e->count, cap, sizeof(e->vals[0]));
+        e->cap = cap;
+    }
+    e->syms[e->count] = k->sym;
+    e->vals[e->count] = lgc_store(e, v);
+    e->count++;
+
+    if (e->count > LENV_HASH_MIN && 2*e->count > e->index_cap)
+        lenv_index(e);
+    else if (e->index)
+        lenv_index_insert(e, e->count-1);
+}
+
+/* the env `=' binds k in: a loop frame only binds its own syms */
+static lenv* lenv_local(lenv* e, lval* k)
+{
+    e = lenv_fwd(e);
+    while (e->loop && lenv_find(e, k->sym) < 0)
+        e = lenv_fwd(e->par);
+    return e;
+}
+
+void lenv_def(lenv* e, lval* k, lval* v)
+{
+    while(e->par) e = e->par;
+    lenv_put(e, k, v);
+}
+
+/* copy the arena object v, and what it refers to in the arena, to the heap */
+lval* lval_promote(lval* v)
+{
+    if (lval_is_fixnum(v) || !larena_has(v))
+        return v;
+    lval* x = larena_memo_get(v);
+    if (x)
+        return x;
+
+    x = lpool_alloc(LPOOL_LVAL);
+    x->gc |= v->gc & (LGC_RESOLVED | LGC_CONST);
+    x->type = v->type;
+    larena_memo_put(v, x);
+    arena.promoted++;
+    switch (v->type)
+    {
+    case LVAL_NUM: x->num = v->num; break;
+    case LVAL_SYM:
+        x->sym = v->sym;
+        x->depth = v->depth;
+        x->slot = v->slot;
+        break;
+    case LVAL_ERR: x->err = strdup(v->err); break;
+    case LVAL_STR: x->str = strdup(v->str); break;
+    case LVAL_FUN:
+        x->buildin = v->buildin;
+        if (v->buildin)
+            x->form = v->form;
+        else
+        {
+            x->env = lgc_store_env(x, v->env);
+            x->formals = lgc_store(x, v->formals);
+            x->body = lgc_store(x, v->body);
+        }
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_BUF:
+        x->count = v->count;
+        x->code = NULL;
+        if (v->base)
+        {
+            int off = v->cell - v->base->cell;
+            x->cap = 0;
+            x->base = lgc_store(x, v->base);
+            x->cell = x->base->cell + off;
+            break;
+        }
+        x->cap = v->count;
+        x->base = NULL;
+        x->cell = malloc(v->count * sizeof(lval*));
+        for (int i=0; i<v->count; i++)
+            x->cell[i] = lgc_store(x, v->cell[i]);
+        break;
+    }
+    return x;
+}
+
+/*
+ * Unlike a value, an env is mutable: e forwards to its copy for good,
+ * instead of going on as a stale twin of it.
+ */
+lenv* lenv_promote(lenv* e)
+{
+    //iterate over the parents, frame chains may be long
+    lenv* top = NULL;
+    lenv* prev = NULL;
+    while (e && larena_has(e))
+    {
+        lenv* x = e->fwd;
+        if (!x)
+        {
+            x = lpool_alloc(LPOOL_LENV);
+            e->fwd = x;
+            arena.promoted++;
+            x->fwd = NULL;
+            x->loop = e->loop;
+            x->par = NULL;
+            x->count = e->count;
+            x->cap = e->count;
+            x->syms = malloc(e->count * sizeof(char*));
+            x->vals = malloc(e->count * sizeof(lval*));
+            for (int i=0; i<e->count; i++)
+            {
+                x->syms[i] = e->syms[i];
+                x->vals[i] = lgc_store(x, e->vals[i]);
+            }
+            lenv_copy_index(x, e);
+        }
+        else
+            e = NULL; //its parents are done
+        if (prev)
+            prev->par = x;
+        else
+            top = x;
+        if (!e)
+            return top;
+        prev = x;
+        e = e->par;
+    }
+
+    if (!prev)
+        return e;
+    lgc_barrier(e);
+    prev->par = e;
+    return top;
+}
+
+lval* buildin_head(lenv *e, lval* v)
+{
+    if (v->count != 2)
+        return lval_err("Function 'head' passed too many arguments, "
+                        "get %d, expectedd %d", 1, v->count);
+    if (lval_type(v->cell[1]) != LVAL_QEXPR)
+        return lval_err("Function 'head' passed incorrect type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(v->cell[1])), ltype_name(LVAL_QEXPR));
+    if (v->cell[1]->count == 0)
+        return lval_err("Function 'head' passed {}!");
+
+    return lval_slice(LVAL_QEXPR, v->cell[1], 0, 1);
+}
+
+lval* buildin_tail(lenv* e, lval* v)
+{
+    if (v->count != 2)
+        return lval_err("Function 'tail' passed too many arguments, "
+                        "get %d, expectedd %d", v->count, 1);
+    if (lval_type(v->cell[1]) != LVAL_QEXPR)
+        return lval_err("Function 'tail' passed incorrect type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(v->cell[1])), ltype_name(LVAL_QEXPR));
+    if (v->cell[1]->count == 0)
+        return lval_err("Function 'tail' passed {}!");
+
+    return lval_view(LVAL_QEXPR, v->cell[1], 1, v->cell[1]->count);
+}
+
+lval* buildin_list(lenv* e, lval* v)
+{
+    return lval_slice(LVAL_QEXPR, v, 1, v->count);
+}
+
+//x y should be Q-Expr
+lval* lval_join(lval* x, lval* y)
+{
+    return lval_append(x, y->cell, y->count);
+}
+
+lval* buildin_join(lenv* e, lval* v)
+{
+    for (int i=1; i<v->count; i++)
+    {
+        if (lval_type(v->cell[i]) != LVAL_QEXPR)
+            return lval_err("Function 'join' passed incorrect type!");
+    }
+
+    lval* x = v->cell[1];
+    int n = 0;
+    for (int i=2; i<v->count; i++)
+        n += v->cell[i]->count;
+
+    //append in place after x, if it is the end of a buffer with room
+    lval* b = x->base;
+    int start = 0;
+    if (b && lval_type(b) == LVAL_BUF && x->cell + x->count == b->cell + b->count
+        && b->cap - b->count >= n)
+        start = x->cell - b->cell;
+    else
+    {
+        b = lval_expr(LVAL_BUF);
+        lval_reserve(b, lgc_cap(x->count + n, x->count + n));
+        lval_join(b, x);
+    }
+    for (int i=2; i<v->count; i++)
+    {
+        lval_join(b, v->cell[i]);
+    }
+
+    return lval_view(LVAL_QEXPR, b, start, b->count);
+}
+
+lval* lval_eval(lenv* e, lval* v);
+
+/*
+ * Tail calls: a call in tail position, of a lambda or of if and eval,
+ * doesn't evaluate the Q-expr it ends with, it leaves it in ltail and
+ * returns LVAL_TAIL. It comes back to lval_eval (or lvm_run), which
+ * evaluates it in place of the call, so a tail recursive loop runs in
+ * constant stack. There is no safepoint on the way, so ltail needn't be
+ * a root.
+ */
+static __thread struct {
+    lenv* e;
+    lval* body;
+} ltail;
+
+static lval ltail_mark;
+#define LVAL_TAIL (&ltail_mark)
+
+static inline lval* lval_tail(lenv* e, lval* body)
+{
+    ltail.e = e;
+    ltail.body = body;
+    return LVAL_TAIL;
+}
+
+lval* buildin_eval(lenv* e, lval* v)
+{
+    if (v->count != 2)
+        return lval_err("Function 'eval' passed too many arguments, "
+                        "get %d, expectedd %d", 1, v->count-1);
+    if (lval_type(v->cell[1]) != LVAL_QEXPR)
+        return lval_err("Function 'eval' passed incorrect type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(v->cell[1])), ltype_name(LVAL_QEXPR));
+//    if (v->cell[0]->count == 0)
+//        return lval_err("Function 'eval' passed {}!");
+    return lval_tail(e, v->cell[1]);
+}
+
+/* the type error for the first argument of v from i which isn't a number */
+static lval* buildin_num_check(lval* v, int i, const char* op)
+{
+    for (; i<v->count; i++)
+    {
+        if (lval_type(v->cell[i]) != LVAL_NUM)
+            return lval_err("Function '%s' passed incorrect type, "
+                            "get <%s>, expected<%s>", op,
+                            ltype_name(lval_type(v->cell[i])), ltype_name(LVAL_NUM));
+    }
+    return NULL;
+}
+
+/* err at the argument i, a bad type after it is still reported first */
+static lval* buildin_op_err(lval* v, int i, const char* op, char* err)
+{
+    lval* x = buildin_num_check(v, i+1, op);
+    return x ? x : lval_err(err);
+}
+
+/*
+ * Arithmetic kernels, one per operator so that the loop does no dispatch:
+ * the type check is folded into it and a fixnum is read straight from the
+ * pointer. The result is a long, going out of it is an error.
+ */
+#define BUILDIN_ARITH(name, op, overflow)                               \
+lval* name(lenv* e, lval* v)                                            \
+{                                                                       \
+    long r = 0;                                                         \
+    for (int i=1; i<v->count; i++)                                      \
+    {                                                                   \
+        lval* x = v->cell[i];                                           \
+        long y;                                                         \
+        if (lval_is_fixnum(x))                                          \
+            y = (intptr_t)x >> 1;                                       \
+        else if (x->type == LVAL_NUM)                                   \
+            y = x->num;                                                 \
+        else                                                            \
+            return buildin_num_check(v, i, op);                         \
+        if (i == 1)                                                     \
+            r = y;                                                      \
+        else if (overflow(r, y, &r))                                    \
+            return buildin_op_err(v, i, op, "Integer overflow!");       \
+    }                                                                   \
+    return lval_num(r);                                                 \
+}
+
+BUILDIN_ARITH(buildin_add, "+", __builtin_add_overflow)
+BUILDIN_ARITH(buildin_sub, "-", __builtin_sub_overflow)
+BUILDIN_ARITH(buildin_mul, "*", __builtin_mul_overflow)
+
+lval* buildin_div(lenv* e, lval* v)
+{
+    lval* x = buildin_num_check(v, 1, "/");
+    if (x)
+        return x;
+
+    long r = lval_numval(v->cell[1]);
+    for (int i=2; i<v->count; i++)
+    {
+        long y = lval_numval(v->cell[i]);
+        if (y == 0)
+            return lval_err("Division by zero!");
+        if (y == -1 && r == LONG_MIN)
+            return lval_err("Integer overflow!");
+        r /= y;
+    }
+    return lval_num(r);
+}
+
+/* comparison kernels, for exactly two numbers */
+#define BUILDIN_ORD(name, op, OP)                                       \
+lval* name(lenv* e, lval* v)                                            \
+{                                                                       \
+    if (v->count != 3)                                                  \
+        return lval_err("Function %s passed incorrent number of arguments, " \
+                        "get %d, expectedd %d", op, 1, v->count-1);     \
+    lval* x = v->cell[1];                                               \
+    lval* y = v->cell[2];                                               \
+    if (lval_is_fixnum(x) && lval_is_fixnum(y)) /* same tag, same order */ \
+        return lval_num((intptr_t)x OP (intptr_t)y);                    \
+    if (lval_type(x) != LVAL_NUM || lval_type(y) != LVAL_NUM)           \
+        return lval_err("Function '%s' passed incorrect type, "         \
+                        "get <%s> <%s>, expected<%s>", op,              \
+                        ltype_name(lval_type(x)), ltype_name(lval_type(y)), \
+                        ltype_name(LVAL_NUM));                          \
+    return lval_num(lval_numval(x) OP lval_numval(y));                  \
+}
+
+BUILDIN_ORD(buildin_gt, ">", >)
+BUILDIN_ORD(buildin_lt, "<", <)
+BUILDIN_ORD(buildin_ge, ">=", >=)
+BUILDIN_ORD(buildin_le, "<=", <=)
+
+int lval_equal(lval* x, lval* y)
+{
+    if (lval_type(x) != lval_type(y))
+        return 0;
+
+    int r = 0;
+    switch(lval_type(x))
+    {
+    case LVAL_ERR: r = !strcmp(x->err, y->err); break;
+    case LVAL_NUM: r = lval_numval(x) == lval_numval(y); break;
+    case LVAL_SYM: r = x->sym == y->sym; break;
+    case LVAL_FUN:
+        if (x->buildin || y->buildin)
+            r = x->buildin == y->buildin;
+        else if (!x->env || !y->env)
+            r = x->env == y->env && lval_equal(x->fn, y->fn)
+                && lval_equal(x->args, y->args);
+        else
+            r = lval_equal(x->formals, y->formals)
+                && lval_equal(x->body, y->body);
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        if (x->count == y->count)
+        {
+            r = !0;
+            for (int i=0; i<x->count; i++)
+            {
+                if (lval_equal(x->cell[i], y->cell[i]) == 0)
+                {
+                    r = 0;
+                    break;
+                }
+            }
+        }
+        break;
+    }
+
+    return r;
+}
+
+/* 1 if the two arguments are equal, -1 on an error */
+static int buildin_cmp(lval* v)
+{
+    if (v->count != 3)
+        return -1;
+    lval* x = v->cell[1];
+    lval* y = v->cell[2];
+    if (lval_is_fixnum(x) || lval_is_fixnum(y)) //a boxed number never fits one
+        return x == y;
+    return lval_equal(x, y);
+}
+
+lval* buildin_eq(lenv* e, lval* v)
+{
+    int r = buildin_cmp(v);
+    if (r < 0)
+        return lval_err("Function %s passed incorrent number of arguments, "
+                        "get %d, expectedd %d", "==", 2, v->count-1);
+    return lval_num(r);
+}
+
+lval* buildin_ne(lenv* e, lval* v)
+{
+    int r = buildin_cmp(v);
+    if (r < 0)
+        return lval_err("Function %s passed incorrent number of arguments, "
+                        "get %d, expectedd %d", "!=", 2, v->count-1);
+    return lval_num(!r);
+}
+
+/*
+ * recur, see buildin_loop, aborts the body up to its loop as an error
+ * does. Anywhere but in tail position it is an error: the S-exprs it
+ * would abort, the cond of an `if', an argument, ..., are waiting for its
+ * value, and so are the loops other than its own.
+ */
+static lval lrecur_mark = {LGC_USED, 0, LVAL_ERR, {.err = "recur outside of loop"}};
+#define LVAL_RECUR (&lrecur_mark)
+
+static __thread lval* lrecur;        //the arguments of recur
+static __thread lenv* lrecur_frame;  //and the frame of its loop
+
+/* x, the value of an expr out of tail position */
+static inline lval* lval_nontail(lval* x)
+{
+    return x == LVAL_RECUR ? lval_err("recur not in tail position") : x;
+}
+
+/*
+ * Special forms: buildins given the cells of the call as they are, by
+ * lval_run and the VM, instead of their values. They evaluate those they
+ * need with lval_form_arg, so `if' only evaluates the branch it takes,
+ * and a literal Q-expr, a branch or a body, is used as it is without
+ * going through the evaluator. A form applied by lval_call (its head
+ * computed, or partially applied) is given the values: a value evaluates
+ * to itself, so it is the same.
+ *
+ * The arguments evaluated with lval_eval recurse on the C stack, which
+ * only matters for a deep recursion through a cond or a defined value,
+ * the branches are evaluated in place.
+ */
+static lval* lval_form_arg(lenv* e, lval* x)
+{
+    switch (lval_type(x))
+    {
+    case LVAL_SYM: return lenv_get(e, x);
+    case LVAL_SEXPR: return lval_nontail(lval_eval(e, x));
+    default: return x;
+    }
+}
+
+/*
+ * The values of the cells of the form v, pushed on the root stack: NULL,
+ * or the first error and nothing pushed.
+ */
+static lval* lval_form_args(lenv* e, lval* v)
+{
+    int sp = gc.vals.count;
+    for (int i=1; i<v->count; i++)
+    {
+        lval* x = lval_form_arg(e, v->cell[i]);
+        if (lval_type(x) == LVAL_ERR)
+        {
+            gc.vals.count = sp;
+            return x;
+        }
+        lgc_push_val(x);
+    }
+    return NULL;
+}
+
+/* (if cond {then} {else}) */
+lval* buildin_if(lenv* e, lval* v)
+{
+    if (v->count-1 != 3)
+        return lval_err("Function 'if' passed incorrent number of arguments, "
+                        "get %d, expectedd %d", v->count-1, 3);
+    lval* cond = lval_form_arg(e, v->cell[1]);
+    if (lval_type(cond) == LVAL_ERR)
+        return cond;
+    if (lval_type(cond) != LVAL_NUM)
+        return lval_err("Function 'if' passed incorrent type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(cond)), ltype_name(LVAL_NUM));
+
+    lval* b = lval_form_arg(e, v->cell[lval_numval(cond) ? 2 : 3]);
+    if (lval_type(b) == LVAL_ERR)
+        return b;
+    if (lval_type(b) != LVAL_QEXPR)
+        return lval_err("Function 'if' passed incorrent type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(b)), ltype_name(LVAL_QEXPR));
+    return lval_tail(e, b);
+}
+
+/*
+ * Loops, special forms run in place: the cond and the body are Q-exprs
+ * evaluated with lval_eval_body, which neither copies nor retypes them,
+ * and the iterations go round the C loop instead of calls.
+ *
+ * while {cond} {body}
+ * dotimes {i} n {body}: body with i bound to 0, ..., n-1
+ * loop {syms} v... {body}: body with syms bound to the values v, again
+ *     with those given to recur if it ends with it; the value of the body
+ * recur v...: back to the start of the loop around it
+ *
+ * dotimes and loop run in a frame of their own, which only binds the
+ * syms: `=' binds the other symbols in the env around it, as it does in
+ * the body of a while, see lenv_local. lval_resolve knows these frames.
+ * recur restarts the loop whose frame is the innermost one of its env,
+ * so the one it is written in: a closure made in the body can't restart
+ * another loop, and one made outside of any loop can't restart any.
+ */
+
+/* the type error for the cell i of v, unless it is of type */
+static lval* buildin_loop_check(lval* v, int i, int type, const char* name)
+{
+    if (lval_type(v->cell[i]) == type)
+        return NULL;
+    return lval_err("Function '%s' passed incorrect type, "
+                    "get <%s>, expected<%s>", name,
+                    ltype_name(lval_type(v->cell[i])), ltype_name(type));
+}
+
+lval* buildin_while(lenv* e, lval* v)
+{
+    if (v->count != 3)
+        return lval_err("Function 'while' passed incorrent number of arguments, "
+                        "get %d, expectedd %d", v->count-1, 2);
+    lval* err = lval_form_args(e, v);
+    if (err)
+        return err;
+    lval* a = lval_sexpr(); //the values, as buildin_loop_check takes them
+    lval_append(a, (lval**)&gc.vals.items[gc.vals.count-2], 2);
+    lgc_pop_vals(2);
+    if ((err = buildin_loop_check(a, 0, LVAL_QEXPR, "while"))
+        || (err = buildin_loop_check(a, 1, LVAL_QEXPR, "while")))
+        return err;
+
+    lgc_push_val(a);
+    lval* x;
+    while (1)
+    {
+        x = lval_nontail(lval_eval_body(e, a->cell[0]));
+        if (lval_type(x) == LVAL_ERR)
+            break;
+        if (lval_type(x) != LVAL_NUM)
+        {
+            x = lval_err("Function 'while' passed incorrent type of cond, "
+                         "get <%s>, expected<%s>",
+                         ltype_name(lval_type(x)), ltype_name(LVAL_NUM));
+            break;
+        }
+        if (!lval_numval(x))
+        {
+            x = lval_sexpr();
+            break;
+        }
+
+        x = lval_nontail(lval_eval_body(e, a->cell[1]));
+        if (lval_type(x) == LVAL_ERR)
+            break;
+    }
+    lgc_pop_vals(1);
+    return x;
+}
+
+enum {LENV_DOTIMES = 1, LENV_LOOP};
+
+/* the frame of a loop in e */
+static lenv* lenv_loop(lenv* e, int n, int loop)
+{
+    lenv* frame = lenv_frame(e, n);
+    frame->loop = loop;
+    return frame;
+}
+
+lval* buildin_dotimes(lenv* e, lval* v)
+{
+    if (v->count != 4)
+        return lval_err("Function 'dotimes' passed incorrent number of arguments, "
+                        "get %d, expectedd %d", v->count-1, 3);
+    lval* err = lval_form_args(e, v);
+    if (err)
+        return err;
+    lval* a = lval_sexpr();
+    lval_append(a, (lval**)&gc.vals.items[gc.vals.count-3], 3);
+    lgc_pop_vals(3);
+    if ((err = buildin_loop_check(a, 0, LVAL_QEXPR, "dotimes"))
+        || (err = buildin_loop_check(a, 1, LVAL_NUM, "dotimes"))
+        || (err = buildin_loop_check(a, 2, LVAL_QEXPR, "dotimes")))
+        return err;
+    lval* syms = a->cell[0];
+    if (syms->count != 1 || lval_type(syms->cell[0]) != LVAL_SYM)
+        return lval_err("Function 'dotimes' passed incorrect type, "
+                        "expected one symbol to bind");
+
+    lgc_push_val(a);
+    lenv* frame = lenv_loop(e, 1, LENV_DOTIMES);
+    lgc_push_env(frame);
+    lval* x = lval_sexpr();
+    long n = lval_numval(a->cell[1]);
+    for (long i=0; i<n; i++)
+    {
+        lenv_put(frame, syms->cell[0], lval_num(i));
+        x = lval_nontail(lval_eval_body(frame, a->cell[2]));
+        if (lval_type(x) == LVAL_ERR)
+            break;
+        x = lval_sexpr();
+    }
+    lgc_pop_envs(1);
+    lgc_pop_vals(1);
+    return x;
+}
+
+lval* buildin_loop(lenv* e, lval* v)
+{
+    if (v->count < 3)
+        return lval_err("Function 'loop' passed incorrent number of arguments, "
+                        "get %d, expectedd at least %d", v->count-1, 2);
+    lval* err = lval_form_args(e, v);
+    if (err)
+        return err;
+    lval* a = lval_sexpr();
+    lval_append(a, (lval**)&gc.vals.items[gc.vals.count-(v->count-1)], v->count-1);
+    lgc_pop_vals(v->count-1);
+    if ((err = buildin_loop_check(a, 0, LVAL_QEXPR, "loop"))
+        || (err = buildin_loop_check(a, a->count-1, LVAL_QEXPR, "loop")))
+        return err;
+    lval* syms = a->cell[0];
+    if (syms->count != a->count-2)
+        return lval_err("Function 'loop' cannot bind incorrect "
+                        "number of values to symbols!");
+    for (int i=0; i<syms->count; i++)
+        if (lval_type(syms->cell[i]) != LVAL_SYM)
+            return lval_err("Function 'loop' passed incorrect type, "
+                            "get <%s>, expected<%s>",
+                            ltype_name(lval_type(syms->cell[i])), ltype_name(LVAL_SYM));
+
+    lgc_push_val(a);
+    lenv* frame = lenv_loop(e, syms->count, LENV_LOOP);
+    lgc_push_env(frame);
+
+    lval** vals = a->cell+1;
+    lval* x;
+    while (1)
+    {
+        for (int i=0; i<syms->count; i++)
+            lenv_put(frame, syms->cell[i], vals[i]);
+        x = lval_eval_body(frame, a->cell[a->count-1]);
+        if (x != LVAL_RECUR || lrecur_frame != lenv_fwd(frame))
+            break;
+        if (lrecur->count-1 != syms->count)
+        {
+            x = lval_err("Function 'recur' passed incorrect number of values, "
+                         "get %d, expectedd %d", lrecur->count-1, syms->count);
+            break;
+        }
+        vals = lrecur->cell+1;
+    }
+    lgc_pop_envs(1);
+    lgc_pop_vals(1);
+    return x;
+}
+
+lval* buildin_recur(lenv* e, lval* v)
+{
+    lenv* frame = lenv_fwd(e);
+    while (frame && frame->loop != LENV_LOOP)
+        frame = lenv_fwd(frame->par);
+    if (!frame)
+        return lval_err("recur outside of loop");
+
+    lval* err = lval_form_args(e, v);
+    if (err)
+        return err;
+    lval* a = lval_sexpr();
+    lval_add(a, v->cell[0]);
+    lval_append(a, (lval**)&gc.vals.items[gc.vals.count-(v->count-1)], v->count-1);
+    lgc_pop_vals(v->count-1);
+    lrecur = a;
+    lrecur_frame = frame;
+    return LVAL_RECUR;
+}
+
+/*
+ * def {x} 1
+ * = {x} 1
+ */
+lval* buildin_val(lenv* e, lval* v, int type)
+{
+    static const char* name_table[] = {
+        "def",
+        "=",
+    };
+    const char* name = name_table[type];
+    if (v->count < 2)
+        return lval_err("Function %s cannot define incorrect"
+                        "number of values to symbols!", name);
+
+    //the symbols and the values, kept on the root stack
+    int sp = gc.vals.count;
+    lval* x = lval_form_args(e, v);
+    if (x)
+        return x;
+    lval** vals = (lval**)&gc.vals.items[sp];
+    lval* syms = vals[0];
+    lval* err = NULL;
+
+    if (lval_type(syms) != LVAL_QEXPR)
+        err = lval_err("Function %s passed incorrect type!", name);
+    else if (syms->count == 0 || syms->count != v->count-2)
+        err = lval_err("Function %s cannot define incorrect"
+                       "number of values to symbols!", name);
+
+    for (int i=0; !err && i<syms->count; i++)
+    {
+        if (lval_type(syms->cell[i]) != LVAL_SYM)
+            err = lval_err("Function %s passed incorrect type, "
+                           "get <%s>, expected<%s>", name,
+                           ltype_name(lval_type(syms->cell[i])), ltype_name(LVAL_SYM));
+    }
+
+    for (int i=0; !err && i<syms->count; i++)
+    {
+        if (type) //global
+            lenv_def(e, syms->cell[i], vals[1+i]);
+        else
+            lenv_put(lenv_local(e, syms->cell[i]), syms->cell[i], vals[1+i]);
+    }
+
+    gc.vals.count = sp;
+    return err ? err : lval_sexpr();
+}
+
+lval* buildin_def_global(lenv* e, lval* v)
+{
+    return buildin_val(e, v, 1); //global
+}
+
+lval* buildin_def_local(lenv* e, lval* v)
+{
+    return buildin_val(e, v, 0); //local
+}
+
+/*
+ * Lexical addressing: when a lambda is made, the symbols of its body
+ * naming its formals, or the formals of the lambdas and the symbols of
+ * the loops around it in the same body, are replaced by references to
+ * their frame and slot. A
+ * reference reads and prints like the symbol. The Q-expr given to \ may
+ * be shared with any value, so it is left alone: the lambda gets a copy
+ * of the code, its S-exprs and Q-exprs, marked LGC_RESOLVED. Only such
+ * code is rewritten later, see lnode_observe. The lambdas made again of
+ * a resolved body, those nested in it, share it. A body is still a
+ * Q-expr which may be evaluated anywhere with eval or redefined with
+ * def, so lenv_get checks the address against the frames and falls back
+ * to the lookup by name.
+ */
+typedef struct lscope lscope;
+struct lscope {
+    lval* formals;
+    lscope* par;
+};
+
+/* slot of sym in the frame of a call, formals are bound in order */
+static int lscope_slot(lval* formals, char* sym)
+{
+    int slot = 0;
+    for (int i=0; i<formals->count; i++)
+    {
+        char* s = formals->cell[i]->sym;
+        if (s == sym)
+            return slot;
+        int seen = 0;
+        for (int j=0; j<i && !seen; j++)
+            seen = formals->cell[j]->sym == s;
+        if (!seen)
+            slot++;
+    }
+    return -1;
+}
+
+/* (\ {formals} {body}) */
+static int lval_is_lambda(lval* v)
+{
+    if (v->count != 3 || lval_type(v->cell[0]) != LVAL_SYM
+        || strcmp(v->cell[0]->sym, "\\")
+        || lval_type(v->cell[1]) != LVAL_QEXPR
+        || lval_type(v->cell[2]) != LVAL_QEXPR)
+        return 0;
+    for (int i=0; i<v->cell[1]->count; i++)
+        if (lval_type(v->cell[1]->cell[i]) != LVAL_SYM)
+            return 0;
+    return 1;
+}
+
+/* (dotimes {i} n {body}) or (loop {syms} v... {body}), see lenv_loop */
+static int lval_is_loop(lval* v)
+{
+    if (v->count < 3 || lval_type(v->cell[0]) != LVAL_SYM
+        || lval_type(v->cell[1]) != LVAL_QEXPR
+        || lval_type(v->cell[v->count-1]) != LVAL_QEXPR)
+        return 0;
+    if (strcmp(v->cell[0]->sym, "loop")
+        && (strcmp(v->cell[0]->sym, "dotimes") || v->count != 4))
+        return 0;
+    for (int i=0; i<v->cell[1]->count; i++)
+        if (lval_type(v->cell[1]->cell[i]) != LVAL_SYM)
+            return 0;
+    return 1;
+}
+
+static lval* lval_resolve(lval* body, lscope* s);
+
+/*
+ * Whether v is a call of a global on constants: numbers, strings, Q-exprs
+ * and other such calls. The code ones are folded, see lnode_fold.
+ */
+int lval_is_fold(lval* v)
+{
+    if (lval_type(v) != LVAL_SEXPR || v->count < 2
+        || lval_type(v->cell[0]) != LVAL_SYM || v->cell[0]->depth >= 0)
+        return 0;
+    for (int i=1; i<v->count; i++)
+    {
+        int t = lval_type(v->cell[i]);
+        if (t == LVAL_SEXPR ? !lval_is_fold(v->cell[i])
+            : t != LVAL_NUM && t != LVAL_STR && t != LVAL_QEXPR)
+            return 0;
+    }
+    return 1;
+}
+
+/* a copy of the code v, resolved in s */
+static lval* lval_resolve_cells(lval* v, lscope* s)
+{
+    lval* x = lval_slice(lval_type(v), v, 0, v->count);
+    x->gc |= LGC_RESOLVED;
+
+    //the body of a lambda or of a loop, its last cell, runs in a frame
+    //binding the symbols of its second one
+    int body = lval_is_lambda(v) || lval_is_loop(v) ? v->count-1 : -1;
+    lscope inner = {body >= 0 ? v->cell[1] : NULL, s};
+    for (int i = body >= 0 ? 2 : 0; i<x->count; i++)
+    {
+        lval* c = x->cell[i];
+        if (i == body)
+        {
+            x->cell[i] = lgc_store(x, lval_resolve(c, &inner));
+            continue;
+        }
+        switch (lval_type(c))
+        {
+        case LVAL_SYM:
+            if (c->depth >= 0)
+                break;
+            int depth = 0;
+            for (lscope* p = s; p; p = p->par, depth++)
+            {
+                int slot = lscope_slot(p->formals, c->sym);
+                if (slot >= 0)
+                {
+                    x->cell[i] = lgc_store(x, lval_ref(c->sym, depth, slot));
+                    break;
+                }
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->cell[i] = lgc_store(x, lval_resolve_cells(c, s));
+            break;
+        }
+    }
+    if (lval_is_fold(x))
+        x->gc |= LGC_CONST;
+    return x;
+}
+
+/* the code of a lambda of body, resolved once */
+static lval* lval_resolve(lval* body, lscope* s)
+{
+    if (body->gc & LGC_RESOLVED)
+        return body;
+    return lval_resolve_cells(body, s);
+}
+
+//note: v is a S-Expr:
+//1. v->cell[0] == "\\"
+//2. v->cell[1] == Q-Expr
+//3. v->cell[2] == Q-Expr
+lval* buildin_lambda(lenv* e, lval* v)
+{
+    if (v->count != 3)
+        return lval_err("Function '\\' passed too many arguments, "
+                        "get %d, expectedd %d", 2, v->count);
+    lval* formals = lval_form_arg(e, v->cell[1]);
+    if (lval_type(formals) == LVAL_ERR)
+        return formals;
+    lgc_push_val(formals);
+    lval* body = lval_form_arg(e, v->cell[2]);
+    lgc_pop_vals(1);
+    if (lval_type(body) == LVAL_ERR)
+        return body;
+    if (lval_type(formals) != LVAL_QEXPR)
+        return lval_err("Function '\\' passed incorrect type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(formals)), ltype_name(LVAL_QEXPR));
+    if (lval_type(body) != LVAL_QEXPR)
+        return lval_err("Function '\\' passed incorrect type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(body)), ltype_name(LVAL_QEXPR));
+
+    //check formals
+    for (int i=0; i<formals->count; i++)
+    {
+        lval*x = formals->cell[i];
+        if (lval_type(x) != LVAL_SYM)
+            return lval_err("cannot define a non-symbol. "
+                            "get <%s>, expected<%s>",
+                            ltype_name(lval_type(x)), ltype_name(LVAL_SYM));
+    }
+
+    lscope s = {formals, NULL};
+    body = lval_resolve(body, &s);
+    return lval_lambda(e, formals, body);
+}
+
+/*
+ * A lambda given fewer arguments than formals: the lambda and the
+ * arguments so far, args (may be NULL) then those of a. Applying it
+ * again adds to a new list of arguments, the lambda is only called, in
+ * one frame, once all of them are there.
+ */
+lval* lval_partial(lval* fn, lval* args, lval* a)
+{
+    int n = args ? args->count : 0;
+    lval* x = lval_sexpr();
+    lval_reserve(x, n + a->count-1);
+    if (args)
+        lval_append(x, args->cell, n);
+    lval_append(x, a->cell+1, a->count-1);
+
+    lval* f = lval_alloc();
+    f->type = LVAL_FUN;
+    f->buildin = NULL;
+    f->env = NULL;
+    f->fn = lgc_store(f, fn);
+    f->args = lgc_store(f, x);
+    return f;
+}
+
+/**
+ * f= a->cell[0]
+ * v: function
+ * a: the function arguments
+ **/
+static int ljit_enabled;
+static lval* ljit_call(lval* f, lval* a);
+lval* lval_call(lenv* e, lval* f, lval* a)
+{
+    if (f->buildin) return f->buildin(e, a);
+
+    //lambda, or a partial application of one
+    lval* args = NULL;
+    if (!f->env)
+    {
+        args = f->args;
+        f = f->fn;
+    }
+    int n = args ? args->count : 0;
+    int argc = n + a->count-1;
+    if (argc > f->formals->count)
+        return lval_err("Function passed too many arguments. "
+                        "Got %i, Expected %i.", a->count-1, f->formals->count-n);
+    if (argc < f->formals->count)
+        return lval_partial(f, args, a);
+    if (ljit_enabled && !args)
+    {
+        lval* x = ljit_call(f, a);
+        if (x)
+            return x;
+    }
+
+    //a fresh frame for the arguments, in the env the lambda closes over
+    lenv* frame = lenv_frame(f->env, argc);
+    for (int i=0; i<n; i++)
+        lenv_put(frame, f->formals->cell[i], args->cell[i]);
+    for (int i=0; i<a->count-1; i++)
+        lenv_put(frame, f->formals->cell[n+i], a->cell[1+i]);
+    return lval_tail(frame, f->body);
+}
+
+void lenv_add_buildin(lenv* e, char* name, lbuildin func)
+{
+    lval* k = lval_sym(name);
+    lval* f = lval_buidin(func);
+    lenv_put(e, k, f);
+}
+/* a special form, see lval_form_arg */
+void lenv_add_form(lenv* e, char* name, lbuildin func)
+{
+    lval* k = lval_sym(name);
+    lval* f = lval_buidin(func);
+    f->form = 1;
+    lenv_put(e, k, f);
+}
+
+
+lval* buildin_print(lenv* e, lval* v);
+lval* buildin_error(lenv* e, lval* v);
+lval* buildin_stats(lenv* e, lval* v);
+void lenv_add_buildins(lenv* e)
+{
+    lenv_add_buildin(e, "list", buildin_list);
+    lenv_add_buildin(e, "head", buildin_head);
+    lenv_add_buildin(e, "tail", buildin_tail);
+    lenv_add_buildin(e, "join", buildin_join);
+    lenv_add_buildin(e, "eval", buildin_eval);
+    lenv_add_form(e, "\\",  buildin_lambda);
+    lenv_add_form(e, "def",  buildin_def_global);
+    lenv_add_form(e, "=",  buildin_def_local);
+
+    lenv_add_buildin(e, ">",  buildin_gt);
+    lenv_add_buildin(e, "<",  buildin_lt);
+    lenv_add_buildin(e, ">=",  buildin_ge);
+    lenv_add_buildin(e, "<=",  buildin_le);
+
+    lenv_add_buildin(e, "==",  buildin_eq);
+    lenv_add_buildin(e, "!=",  buildin_ne);
+
+    lenv_add_form(e, "if",  buildin_if);
+    lenv_add_form(e, "while",  buildin_while);
+    lenv_add_form(e, "dotimes",  buildin_dotimes);
+    lenv_add_form(e, "loop",  buildin_loop);
+    lenv_add_form(e, "recur",  buildin_recur);
+
+    lenv_add_buildin(e, "+", buildin_add);
+    lenv_add_buildin(e, "-", buildin_sub);
+    lenv_add_buildin(e, "*", buildin_mul);
+    lenv_add_buildin(e, "/", buildin_div);
+    lenv_add_buildin(e, "print", buildin_print);
+    lenv_add_buildin(e, "error", buildin_error);
+    lenv_add_buildin(e, "stats", buildin_stats);
+}
+
+void lval_print(lval *v);
+void lval_expr_print(lval *v, char open, char close)
+{
+    putchar(open);
+    for (int i=0; i <v->count; i++)
+    {
+        lval_print(v->cell[i]);
+        if (i != v->count-1)
+            putchar(' ');
+    }
+    putchar(close);
+}
+
+/* v as it is read, with the escapes of mpcf_unescape */
+void lval_str_print(lval* v)
+{
+    static const char chars[] = "\a\b\f\n\r\t\v\\\'\"";
+    static const char escapes[] = "abfnrtv\\'\"";
+    putchar('"');
+    for (char* s = v->str; *s; s++)
+    {
+        const char* c = strchr(chars, *s);
+        if (c)
+            printf("\\%c", escapes[c-chars]);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+void lval_print(lval *v)
+{
+    switch (lval_type(v))
+    {
+    case LVAL_ERR: printf("Error: %s", v->err); break;
+    case LVAL_NUM: printf("%ld", lval_numval(v)); break;
+    case LVAL_SYM: printf("%s", v->sym); break;
+    case LVAL_STR: lval_str_print(v); break;
+    case LVAL_FUN:
+        if (v->buildin)
+        {
+            printf("<buildin: %p>", v->buildin);
+        }
+        else if (!v->env)
+        {
+            //the formals left
+            lval* f = v->fn;
+            printf("(\\ {");
+            for (int i=v->args->count; i<f->formals->count; i++)
+            {
+                lval_print(f->formals->cell[i]);
+                if (i != f->formals->count-1)
+                    putchar(' ');
+            }
+            printf("} ");
+            lval_print(f->body);
+            putchar(')');
+        }
+        else
+        {
+            printf("(\\ ");
+            lval_print(v->formals);
+            putchar(' ');
+            lval_print(v->body);
+            putchar(')');
+        }
+        break;
+    case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
+    case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+    }
+}
+
+void lval_println(lval *v)
+{
+    lval_print(v);
+    putchar('\n');
+}
+
+lval* buildin_print(lenv* e, lval* v)
+{
+    for (int i=1; i<v->count; i++)
+    {
+        lval_print(v->cell[i]);
+        putchar(' ');
+    }
+    putchar('\n');
+
+    return lval_sexpr();
+}
+
+lval* buildin_error(lenv* e, lval* v)
+{
+    if (v->count != 2)
+        return lval_err("Function 'error' passed too many arguments, "
+                        "get %d, expectedd %d", 1, v->count);
+    if (lval_type(v->cell[1]) != LVAL_STR)
+        return lval_err("Function 'error' passed incorrect type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(v->cell[1])), ltype_name(LVAL_STR));
+
+    return lval_err(v->cell[1]->str);
+}
+
+/* see lnode_eval and lnode_fold */
+static __thread struct {
+    long rewrites;
+    long deopts;
+    long folds;
+    long unfolds;
+} lnodes;
+
+/*
+ * stats "mem"
+ * stats "gc"
+ * stats "nodes"
+ * stats "folds"
+ */
+lval* buildin_stats(lenv* e, lval* v)
+{
+    if (v->count != 2)
+        return lval_err("Function 'stats' passed too many arguments, "
+                        "get %d, expectedd %d", v->count-1, 1);
+    if (lval_type(v->cell[1]) != LVAL_STR)
+        return lval_err("Function 'stats' passed incorrect type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(v->cell[1])), ltype_name(LVAL_STR));
+
+    const char* what = v->cell[1]->str;
+    if (!strcmp(what, "mem"))
+    {
+        lpool_stat st[LPOOL_MAX];
+        lpool_stats(st);
+        for (int i=0; i<LPOOL_MAX; i++)
+            printf("%s: live %ld, %ld bytes, slabs %ld bytes\n", st[i].name,
+                   st[i].live, st[i].live_bytes, st[i].slab_bytes);
+        printf("arena: %zu bytes, resets %ld, promoted %ld\n",
+               arena.bytes, arena.resets, arena.promoted);
+    }
+    else if (!strcmp(what, "gc"))
+    {
+        printf("gc: %s, cycles %ld, freed %ld, threshold %ld\n",
+               gc.incremental ? "incremental" : "stop-the-world",
+               gc.cycles, gc.freed, gc.threshold);
+        printf("pauses: %ld, total %ldus, max %ldus\n",
+               gc.pause_count, gc.pause_total_us, gc.pause_max_us);
+        for (int i=0; i<LGC_PAUSE_BUCKETS; i++)
+        {
+            if (!gc.pauses[i])
+                continue;
+            if (i == 0)
+                printf("  <1us: %ld\n", gc.pauses[i]);
+            else if (i == LGC_PAUSE_BUCKETS-1)
+                printf("  >=%ldus: %ld\n", 1L << (i-1), gc.pauses[i]);
+            else
+                printf("  %ld-%ldus: %ld\n", 1L << (i-1), 1L << i, gc.pauses[i]);
+        }
+    }
+    else if (!strcmp(what, "nodes"))
+        printf("nodes: rewrites %ld, deopts %ld\n", lnodes.rewrites, lnodes.deopts);
+    else if (!strcmp(what, "folds"))
+        printf("folds: %ld, undone %ld\n", lnodes.folds, lnodes.unfolds);
+    else
+        return lval_err("Function 'stats' unknown stats %s", what);
+
+    return lval_sexpr();
+}
+
+/*
+ * lval_eval doesn't recurse: the S-exprs whose cells are being evaluated
+ * wait on the continuation stack, with the values of the cells so far
+ * in a, so the next cell to evaluate is v->cell[a->count]. The depth of
+ * the recursion is only limited by memory. The continuations are roots.
+ */
+typedef struct lkont {
+    lenv* e;
+    lval* v;
+    lval* a;
+} lkont;
+
+static __thread struct {
+    lkont* items;
+    int count;
+    int cap;
+} lkonts;
+
+static void lkont_push(lenv* e, lval* v)
+{
+    if (lkonts.count == lkonts.cap)
+    {
+        lkonts.cap = lkonts.cap ? lkonts.cap*2 : 64;
+        lkonts.items = realloc(lkonts.items, lkonts.cap * sizeof(lkont));
+    }
+    lval* a = lval_sexpr();
+    lval_reserve(a, v->count);
+    lkonts.items[lkonts.count++] = (lkont){e, v, a};
+}
+
+static void lkont_mark(void)
+{
+    for (int i=0; i<lkonts.count; i++)
+    {
+        lgc_mark(lkonts.items[i].e);
+        lgc_mark(lkonts.items[i].v);
+        lgc_mark(lkonts.items[i].a);
+    }
+}
+
+/* the cells of the S-expr are evaluated into a, apply them */
+static lval* lval_apply(lenv* e, lval* a)
+{
+    if (a->count == 1)
+        return a->cell[0];
+
+    //get the first child of S-expr, it should be a `symbol'
+    lval* f = a->cell[0];
+    if (lval_type(f) != LVAL_FUN)
+        return lval_err("first emlempent is not a function!");
+
+    return lval_call(e, f, a);
+}
+
+/*
+ * Evaluate v in e, or the cells of v as an S-expr when cells is set: the
+ * body of a lambda, or the Q-expr run by if and eval. Code is read only,
+ * it is neither copied nor retyped to be run, so a body is shared by all
+ * the calls; the values go to the continuations.
+ */
+static int lvm_enabled;
+static int lvm_body(lval* body);
+static lbuildin lval_native(lval* body);
+static lval* lnode_eval(lenv* e, lval* v);
+static lval* lnode_fold(lenv* e, lval* v);
+static void lnode_observe(lval* v, lval* f, lval* a, lval* x);
+static lval* lval_run(lenv* e, lval* v, int cells)
+{
+    int base = lkonts.count;
+    lgc_push_env(e);
+    lgc_push_val(v);
+    lval* x;
+    if (cells)
+        goto body;
+
+eval:
+    gc.envs.items[gc.envs.count-1] = e;
+    gc.vals.items[gc.vals.count-1] = v;
+    lgc_safepoint();
+    x = v;
+    if (lval_type(v) == LVAL_SYM)
+        x = lenv_get(e, v);
+    else if (lval_type(v) == LVAL_SEXPR && v->count)
+    {
+        //a rewritten node, NULL when it is back to the generic path
+        x = v->gc & LGC_CONST ? lnode_fold(e, v) : NULL;
+        if (!x && v->code)
+            x = lnode_eval(e, v);
+        if (x)
+            goto tail;
+        goto call;
+    }
+
+    while (lkonts.count > base)
+    {
+        int k = lkonts.count-1;
+        //an error aborts the S-exprs, which a recur can't
+        if (lval_type(x) == LVAL_ERR)
+        {
+            x = lval_nontail(x);
+            lkonts.count--;
+            continue;
+        }
+
+        lval* a = lkonts.items[k].a;
+        lval_add(a, x);
+        if (a->count < lkonts.items[k].v->count)
+        {
+            e = lkonts.items[k].e;
+            v = lkonts.items[k].v->cell[a->count];
+            goto eval;
+        }
+
+        e = lkonts.items[k].e;
+        x = lval_apply(e, a);
+        lnode_observe(lkonts.items[k].v, a->cell[0], a, x);
+        lkonts.count = k;
+    tail:
+        if (x != LVAL_TAIL)
+            continue;
+
+        //a tail call, evaluate its body in place of the S-expr
+        e = ltail.e;
+        v = ltail.body;
+        if (lvm_body(v) || lval_native(v))
+        {
+            gc.envs.items[gc.envs.count-1] = e;
+            x = lval_eval_body(e, v);
+            continue;
+        }
+
+    body:
+        if (!v->count)
+        {
+            x = lval_sexpr();
+            continue;
+        }
+        gc.envs.items[gc.envs.count-1] = e;
+        gc.vals.items[gc.vals.count-1] = v;
+
+    call:
+        //the head first, a special form is given the cells as they are
+        x = lval_type(v->cell[0]) == LVAL_SYM ? lenv_get(e, v->cell[0]) : NULL;
+        if (x && v->count > 1 && lval_is_form(x))
+        {
+            lval* f = x;
+            x = f->buildin(e, v);
+            if (lval_type(v) == LVAL_SEXPR)
+                lnode_observe(v, f, NULL, x);
+            goto tail;
+        }
+
+        //v may be shared, the values of the cells are collected apart
+        lkont_push(e, v);
+        if (x)
+            continue;
+        v = v->cell[0];
+        goto eval;
+    }
+
+    lgc_pop_vals(1);
+    lgc_pop_envs(1);
+    return x;
+}
+
+lval* lval_eval(lenv* e, lval* v)
+{
+    return lval_run(e, v, 0);
+}
+
+/*
+ * Bytecode VM, enabled by --vm.
+ *
+ * Lambda bodies are compiled the first time they run into code for a
+ * stack machine, and top-level forms just before they run. The value
+ * stack of the VM is the root stack of the collector, so the values on
+ * it are never collected. Calls still go through lval_call, which runs
+ * the body of the callee in the VM again, except for the calls in tail
+ * position which replace the running code.
+ *
+ * The code keeps the semantics of lval_eval: symbols are looked up when
+ * they are reached, so `if' and the arithmetic builtins, which get an
+ * inline fast path, are checked to be the builtins at run time, and the
+ * generic call is made otherwise. Anything the fast paths don't handle
+ * (a wrong type, too many arguments, ...) goes to the builtin too, so
+ * the errors are the same. The first error aborts the code.
+ *
+ * The code only points to the expr it is compiled from, and the values
+ * it holds, so it is freed along with the expr. Bodies living in an
+ * arena are not compiled, they run in lval_eval.
+ */
+enum {
+    LOP_CONST,  //push v
+    LOP_NIL,    //push ()
+    LOP_LOCAL,  //push the value of the symbol v with a lexical address,
+                //a: its depth, b: its slot
+    LOP_GLOBAL, //push the value of the symbol v
+    LOP_CALL,   //call the top a values, the function first, b: a tail call;
+                //v: the form v, given its cells, the top is the function
+    LOP_FORM,   //jump to a if the top is a special form
+    LOP_PRIM,   //LOP_CALL, with a fast path when the function is f
+    LOP_FOLDED, //push the value of the call on constants v and jump to a
+                //if it folds, see lnode_fold
+    LOP_GUARD,  //jump to a unless the top is the builtin f
+    LOP_BRANCH, //the function and cond of `if': jump to a if cond is 0,
+                //to b if it isn't a number, continue otherwise
+    LOP_JUMP,   //jump to a
+    LOP_RET,
+    LOP_NATIVE, //the whole code: the body compiled to f, see lispy_native
+    LOP_ARITH,  //the whole code of an S-expr node, see lnode_eval:
+                //the kernel f on two operands,
+    LOP_KNOWN,  //a call of the global lambda of a formals,
+    LOP_FOLD,   //the value v of the pure builtin f on constants,
+    LOP_DEOPT,  //or the generic path, b: the number of deopts so far
+};
+
+typedef struct lins {
+    int op;
+    int a;
+    int b;
+    lval* v;
+    lbuildin f;
+} lins;
+
+struct lcode {
+    int count;
+    int cap;
+    lins ins[];
+};
+
+static lcode* lvm_emit(lcode* c, int op, int a, lval* v, lbuildin f)
+{
+    if (c->count == c->cap)
+    {
+        c->cap *= 2;
+        c = realloc(c, sizeof(lcode) + c->cap * sizeof(lins));
+    }
+    c->ins[c->count++] = (lins){op, a, 0, v, f};
+    return c;
+}
+
+static const struct {
+    const char* name;
+    lbuildin f;
+} lvm_prims[] = {
+    {"+", buildin_add}, {"-", buildin_sub}, {"*", buildin_mul}, {"/", buildin_div},
+    {">", buildin_gt}, {"<", buildin_lt}, {">=", buildin_ge}, {"<=", buildin_le},
+    {"==", buildin_eq}, {"!=", buildin_ne},
+};
+
+/* the global builtin the head of v names, for the fast paths */
+static lbuildin lvm_prim(lval* v)
+{
+    lval* x = v->cell[0];
+    if (lval_type(x) != LVAL_SYM || x->depth >= 0)
+        return NULL;
+    if (v->count == 4 && !strcmp(x->sym, "if")
+        && lval_type(v->cell[2]) == LVAL_QEXPR
+        && lval_type(v->cell[3]) == LVAL_QEXPR)
+        return buildin_if;
+    for (int i=0; v->count == 3 && i<(int)(sizeof(lvm_prims)/sizeof(lvm_prims[0])); i++)
+        if (!strcmp(x->sym, lvm_prims[i].name))
+            return lvm_prims[i].f;
+    return NULL;
+}
+
+static lcode* lvm_emit_expr(lcode* c, lval* x);
+
+/*
+ * The call of the special form v, to which LOP_FORM at form jumps, after
+ * the generic call just emitted. It and the jumps j1, j2 (-1 if none)
+ * go past it.
+ */
+static lcode* lvm_emit_form(lcode* c, lval* v, int form, int j1, int j2)
+{
+    int jump = c->count;
+    c = lvm_emit(c, LOP_JUMP, 0, NULL, NULL);
+    c->ins[form].a = c->count;
+    c = lvm_emit(c, LOP_CALL, 1, v, NULL);
+    c->ins[jump].a = c->count;
+    if (j1 >= 0)
+        c->ins[j1].a = c->count;
+    if (j2 >= 0)
+        c->ins[j2].a = c->count;
+    return c;
+}
+
+static lcode* lvm_emit_call(lcode* c, lval* v, lbuildin f);
+
+/* the cells of v as an S-expr, empty is nil when v isn't one */
+static lcode* lvm_emit_sexpr(lcode* c, lval* v)
+{
+    if (v->count == 0)
+        return lval_type(v) == LVAL_SEXPR ? lvm_emit(c, LOP_CONST, 0, v, NULL)
+                                          : lvm_emit(c, LOP_NIL, 0, NULL, NULL);
+    if (v->count == 1)
+        return lvm_emit_expr(c, v->cell[0]);
+
+    lbuildin f = lvm_prim(v);
+    if (!(v->gc & LGC_CONST) || f == buildin_if)
+        return lvm_emit_call(c, v, f);
+
+    //the call when it doesn't fold
+    int fold = c->count;
+    c = lvm_emit(c, LOP_FOLDED, 0, v, NULL);
+    c = lvm_emit_call(c, v, f);
+    c->ins[fold].a = c->count;
+    return c;
+}
+
+/* the call v, f: the builtin of the fast path, see lvm_prim */
+static lcode* lvm_emit_call(lcode* c, lval* v, lbuildin f)
+{
+    if (f == buildin_if)
+    {
+        c = lvm_emit_expr(c, v->cell[0]);
+        int guard = c->count;
+        c = lvm_emit(c, LOP_GUARD, 0, NULL, buildin_if);
+        c = lvm_emit_expr(c, v->cell[1]);
+        int branch = c->count;
+        c = lvm_emit(c, LOP_BRANCH, 0, NULL, NULL);
+        c = lvm_emit_sexpr(c, v->cell[2]);
+        int jump = c->count;
+        c = lvm_emit(c, LOP_JUMP, 0, NULL, NULL);
+        c->ins[branch].a = c->count;
+        c = lvm_emit_sexpr(c, v->cell[3]);
+        int jump2 = c->count;
+        c = lvm_emit(c, LOP_JUMP, 0, NULL, NULL);
+
+        //not the builtin, or a cond which isn't a number
+        c->ins[guard].a = c->count;
+        int form = c->count;
+        c = lvm_emit(c, LOP_FORM, 0, NULL, NULL);
+        c = lvm_emit_expr(c, v->cell[1]);
+        c->ins[branch].b = c->count;
+        c = lvm_emit(c, LOP_CONST, 0, v->cell[2], NULL);
+        c = lvm_emit(c, LOP_CONST, 0, v->cell[3], NULL);
+        c = lvm_emit(c, LOP_CALL, 4, NULL, NULL);
+        return lvm_emit_form(c, v, form, jump, jump2);
+    }
+
+    //the arithmetic is a call when it isn't the builtin, never a form
+    c = lvm_emit_expr(c, v->cell[0]);
+    if (f)
+    {
+        for (int i=1; i<v->count; i++)
+            c = lvm_emit_expr(c, v->cell[i]);
+        return lvm_emit(c, LOP_PRIM, v->count, NULL, f);
+    }
+
+    int form = c->count;
+    c = lvm_emit(c, LOP_FORM, 0, NULL, NULL);
+    for (int i=1; i<v->count; i++)
+        c = lvm_emit_expr(c, v->cell[i]);
+    c = lvm_emit(c, LOP_CALL, v->count, NULL, NULL);
+    return lvm_emit_form(c, v, form, -1, -1);
+}
+
+static lcode* lvm_emit_expr(lcode* c, lval* x)
+{
+    switch (lval_type(x))
+    {
+    case LVAL_SYM:
+        if (x->depth < 0)
+            return lvm_emit(c, LOP_GLOBAL, 0, x, NULL);
+        c = lvm_emit(c, LOP_LOCAL, x->depth, x, NULL);
+        c->ins[c->count-1].b = x->slot;
+        return c;
+    case LVAL_SEXPR:
+        return lvm_emit_sexpr(c, x);
+    default:
+        return lvm_emit(c, LOP_CONST, 0, x, NULL);
+    }
+}
+
+/* the code of x, or of the cells of x as an S-expr for a body */
+static lcode* lvm_compile(lval* x, int body)
+{
+    lcode* c = malloc(sizeof(lcode) + 16 * sizeof(lins));
+    c->count = 0;
+    c->cap = 16;
+    c = body ? lvm_emit_sexpr(c, x) : lvm_emit_expr(c, x);
+    c = lvm_emit(c, LOP_RET, 0, NULL, NULL);
+
+    //mark the calls in tail position
+    for (int i=0; i<c->count; i++)
+    {
+        if (c->ins[i].op != LOP_CALL && c->ins[i].op != LOP_PRIM)
+            continue;
+        int n = i+1;
+        while (c->ins[n].op == LOP_JUMP)
+            n = c->ins[n].a;
+        c->ins[i].b = c->ins[n].op == LOP_RET;
+    }
+    return c;
+}
+
+static void lvm_free(lcode* c)
+{
+    free(c);
+}
+
+/*
+ * The compiled C of a body, NULL if it has none. The C recursion of the
+ * native calls is bounded by the stack they use: lnative_base is where
+ * the outermost one started, and past lnative_room bytes below it the
+ * bodies are interpreted, which recurse on the heap. The room is the
+ * stack limit less LNATIVE_MARGIN for the frames above the outermost
+ * call and those of the interpreter under the innermost.
+ */
+#define LNATIVE_MARGIN (256 * 1024)
+#define LNATIVE_STACK (8 * 1024 * 1024)
+static __thread int lnative_depth;
+static __thread uintptr_t lnative_base;
+static __thread long lnative_room;
+
+static long lnative_limit(void)
+{
+    struct rlimit r;
+    long n = LNATIVE_STACK;
+    if (getrlimit(RLIMIT_STACK, &r) == 0 && r.rlim_cur != RLIM_INFINITY
+        && r.rlim_cur < LNATIVE_STACK)
+        n = r.rlim_cur;
+    return n > 2 * LNATIVE_MARGIN ? n - LNATIVE_MARGIN : n / 2;
+}
+
+static lbuildin lval_native(lval* body)
+{
+    char here;
+    if (!body->code || body->code->ins[0].op != LOP_NATIVE)
+        return NULL;
+    if (!lnative_room)
+        lnative_room = lnative_limit();
+    if (!lnative_depth)
+        lnative_base = (uintptr_t)&here;
+    else if (labs((long)(lnative_base - (uintptr_t)&here)) > lnative_room)
+        return NULL;
+    return body->code->ins[0].f;
+}
+
+/* whether body runs in lvm_run, a native one only past lnative_room */
+static int lvm_body(lval* body)
+{
+    return lvm_enabled && !larena_has(body)
+        && (!body->code || body->code->ins[0].op != LOP_NATIVE);
+}
+
+/* the fast path of LOP_PRIM, NULL if it doesn't apply */
+static lval* lvm_arith(lbuildin f, lval* x, lval* y)
+{
+    if (!lval_is_fixnum(x) || !lval_is_fixnum(y))
+        return NULL;
+
+    long a = lval_numval(x), b = lval_numval(y), r;
+    if (f == buildin_add) r = a + b;
+    else if (f == buildin_sub) r = a - b;
+    else if (f == buildin_mul)
+    {
+        if (__builtin_mul_overflow(a, b, &r))
+            return NULL;
+    }
+    else if (f == buildin_div)
+    {
+        if (b == 0)
+            return NULL;
+        r = a / b;
+    }
+    else if (f == buildin_gt) r = a > b;
+    else if (f == buildin_lt) r = a < b;
+    else if (f == buildin_ge) r = a >= b;
+    else if (f == buildin_le) r = a <= b;
+    else if (f == buildin_eq) r = a == b;
+    else if (f == buildin_ne) r = a != b;
+    else return NULL;
+    return lval_num(r);
+}
+
+/*
+ * Node rewriting, for lval_run: an S-expr of a lambda body which is seen
+ * applied to operands of the right types rewrites itself into a node
+ * specialized to them, its code:
+ *  - LOP_ARITH: (op x y), op the global bound to an arithmetic or a
+ *    comparison builtin, on two fixnums,
+ *  - LOP_KNOWN: (f x ...), f the global bound to a lambda taking those
+ *    arguments, called without collecting its arguments into an S-expr,
+ *  - LOP_FOLD: (f c ...), f the global bound to a pure builtin and the
+ *    c constants, literals or other LOP_FOLD nodes: its value, kept in
+ *    the node (an `if' keeps the branch it takes). Those are the calls
+ *    lval_resolve flags LGC_CONST, folded by lnode_fold the first time
+ *    they run, in every evaluator; the `if' ones are seen here.
+ * The operands are numbers, symbols or other LOP_ARITH nodes, which have
+ * no effect, so the node is evaluated at once, without the continuation
+ * stack. The assumptions are checked each time it runs, the bindings and
+ * the types may change; when one doesn't hold the node deoptimizes back
+ * to LOP_DEOPT and runs the generic path, until it is seen again. After
+ * LNODE_DEOPTS of them it stays there.
+ *
+ * S-exprs are never bodies, so their code is only ever a node. Only
+ * the S-exprs of the code a lambda owns, marked by lval_resolve, are
+ * rewritten: not those of a Q-expr the program holds as data and gives
+ * to eval. Nor those of an arena, the code would outlive them.
+ */
+#define LNODE_DEOPTS 4
+#define LNODE_ARGS 6
+
+static lval* lnode_operand(lenv* e, lval* x)
+{
+    switch (lval_type(x))
+    {
+    case LVAL_NUM:
+        return x;
+    case LVAL_SYM:
+        x = lenv_get(e, x);
+        return lval_type(x) == LVAL_ERR ? NULL : x;
+    case LVAL_SEXPR:
+        return x->code && (x->code->ins[0].op == LOP_ARITH
+                           || x->code->ins[0].op == LOP_FOLD) ? lnode_eval(e, x) : NULL;
+    }
+    return NULL;
+}
+
+/* the value of the node v, NULL if an assumption doesn't hold */
+static lval* lnode_run(lenv* e, lval* v, lins* n)
+{
+    lval* f = lenv_get(e, v->cell[0]);
+    if (lval_type(f) != LVAL_FUN)
+        return NULL;
+
+    //the folded operands are checked in turn, their heads may have changed
+    if (n->op == LOP_FOLD)
+    {
+        if (f->buildin != n->f)
+            return NULL;
+        for (int i=1; i<v->count; i++)
+            if (lval_type(v->cell[i]) == LVAL_SEXPR && !lnode_eval(e, v->cell[i]))
+                return NULL;
+        return n->f == buildin_if ? lval_tail(e, n->v) : n->v;
+    }
+
+    if (n->op == LOP_ARITH)
+    {
+        lval* x;
+        lval* y;
+        if (f->buildin != n->f || !(x = lnode_operand(e, v->cell[1]))
+            || !(y = lnode_operand(e, v->cell[2])))
+            return NULL;
+        return lvm_arith(n->f, x, y);
+    }
+
+    if (f->buildin || !f->env || f->formals->count != n->a)
+        return NULL;
+    lval* args[LNODE_ARGS];
+    for (int i=0; i<n->a; i++)
+        if (!(args[i] = lnode_operand(e, v->cell[1+i])))
+            return NULL;
+
+    //as lval_call does
+    lenv* frame = lenv_frame(f->env, n->a);
+    for (int i=0; i<n->a; i++)
+        lenv_put(frame, f->formals->cell[i], args[i]);
+    return lval_tail(frame, f->body);
+}
+
+static lval* lnode_eval(lenv* e, lval* v)
+{
+    lins* n = &v->code->ins[0];
+    if (n->op == LOP_DEOPT)
+        return NULL;
+
+    lval* x = lnode_run(e, v, n);
+    if (!x)
+    {
+        if (n->op == LOP_FOLD && n->f != buildin_if)
+            lnodes.unfolds++;
+        n->op = LOP_DEOPT;
+        n->b++;
+        lnodes.deopts++;
+    }
+    return x;
+}
+
+/* whether the head of v is the name of a global */
+static int lnode_global(lval* v)
+{
+    lval* k = v->cell[0];
+    return lval_type(k) == LVAL_SYM && k->depth < 0;
+}
+
+static int lnode_simple(lval* x)
+{
+    int t = lval_type(x);
+    return t == LVAL_NUM || t == LVAL_SYM
+        || (t == LVAL_SEXPR && x->code && (x->code->ins[0].op == LOP_ARITH
+                                           || x->code->ins[0].op == LOP_FOLD));
+}
+
+/* whether v, giving x, is an `if' on constants, see lnode_fold for the others */
+static int lnode_foldable(lval* v, lval* f, lval* x)
+{
+    if (f->buildin != buildin_if || x != LVAL_TAIL)
+        return 0;
+    int pure = 1;
+    for (int i=1; pure && i<v->count; i++)
+    {
+        lval* c = v->cell[i];
+        int t = lval_type(c);
+        if (t == LVAL_SEXPR)
+            pure = c->code && c->code->ins[0].op == LOP_FOLD;
+        else
+            pure = t == LVAL_NUM || t == LVAL_STR || t == LVAL_QEXPR;
+    }
+    return pure;
+}
+
+/* make n the node of v, 0 if it can't */
+static int lnode_set(lval* v, lins n)
+{
+    if (!v->code)
+    {
+        lcode* c = malloc(sizeof(lcode) + sizeof(lins));
+        if (!c)
+            return 0; //left to the generic path
+        c->count = 1;
+        c->cap = 1;
+        v->code = c;
+    }
+    v->code->ins[0] = n;
+    if (n.v)
+        v->code->ins[0].v = lgc_store(v, n.v);
+    return 1;
+}
+
+/*
+ * v, the head f applied to the values a, gave x: rewrite it if they fit
+ * a node. a is NULL for a special form, given the cells as they are.
+ */
+static void lnode_observe(lval* v, lval* f, lval* a, lval* x)
+{
+    if (lval_type(v) != LVAL_SEXPR || !(v->gc & LGC_RESOLVED)
+        || larena_has(v) || !lnode_global(v))
+        return;
+    if (v->code && (v->code->ins[0].op != LOP_DEOPT || v->code->ins[0].b >= LNODE_DEOPTS))
+        return;
+    if (lval_type(f) != LVAL_FUN)
+        return;
+
+    lins n = {LOP_DEOPT, v->count-1, v->code ? v->code->ins[0].b : 0, NULL, NULL};
+    if (lnode_foldable(v, f, x))
+    {
+        n.op = LOP_FOLD;
+        n.v = f->buildin == buildin_if ? ltail.body : x;
+        n.f = f->buildin;
+    }
+    else if (!a)
+        return;
+    else
+    {
+        for (int i=1; i<v->count; i++)
+            if (!lnode_simple(v->cell[i]))
+                return;
+        if (f->buildin && a->count == 3
+            && lval_is_fixnum(a->cell[1]) && lval_is_fixnum(a->cell[2]))
+        {
+            for (int i=0; i<(int)(sizeof(lvm_prims)/sizeof(lvm_prims[0])); i++)
+                if (f->buildin == lvm_prims[i].f)
+                    n.op = LOP_ARITH;
+            n.f = f->buildin;
+        }
+        //the JIT has its own path in lval_call
+        else if (!f->buildin && f->env && f->formals->count == a->count-1
+                 && a->count-1 <= LNODE_ARGS && !ljit_enabled)
+            n.op = LOP_KNOWN;
+    }
+    if (n.op != LOP_DEOPT && lnode_set(v, n))
+        lnodes.rewrites++;
+}
+
+/* the pure builtins, whose calls on constants are folded */
+static lbuildin lnode_pure[] = {
+    buildin_add, buildin_sub, buildin_mul, buildin_div,
+    buildin_gt, buildin_lt, buildin_ge, buildin_le, buildin_eq, buildin_ne,
+    buildin_list, buildin_head, buildin_tail, buildin_join,
+};
+
+/*
+ * The value of v, a call flagged LGC_CONST, folded: its LOP_FOLD node,
+ * made the first time with the builtins its heads are bound to then, or
+ * again after a deopt, LNODE_DEOPTS times at most. NULL for the generic
+ * path: a head which isn't a pure builtin, a call which fails, an `if',
+ * left to lnode_observe, or a node of another kind.
+ */
+static lval* lnode_fold(lenv* e, lval* v)
+{
+    int deopts = 0;
+    if (v->code)
+    {
+        lins* n = &v->code->ins[0];
+        if (n->op == LOP_FOLD && n->f != buildin_if)
+        {
+            lval* x = lnode_eval(e, v);
+            if (x)
+                return x;
+        }
+        if (n->op != LOP_DEOPT || n->b >= LNODE_DEOPTS)
+            return NULL;
+        deopts = n->b;
+    }
+    if (larena_has(v))
+        return NULL;
+
+    lval* f = lenv_get(e, v->cell[0]);
+    if (lval_type(f) != LVAL_FUN || f->buildin == buildin_if)
+        return NULL;
+    int pure = 0;
+    for (int i=0; i<(int)(sizeof(lnode_pure)/sizeof(lnode_pure[0])); i++)
+        pure |= f->buildin == lnode_pure[i];
+
+    //the builtins are given a new S-expr of the values, as lval_call does
+    lval* x = NULL;
+    lval* a = pure ? lval_add(lval_sexpr(), f) : NULL;
+    for (int i=1; a && i<v->count; i++)
+    {
+        lval* c = v->cell[i];
+        if (lval_type(c) == LVAL_SEXPR && !(c = lnode_fold(e, c)))
+            a = NULL;
+        else
+            lval_add(a, c);
+    }
+    if (a)
+        x = f->buildin(e, a);
+    if (!x || lval_type(x) == LVAL_ERR)
+    {
+        lnode_set(v, (lins){LOP_DEOPT, v->count-1, deopts+1, NULL, NULL});
+        return NULL;
+    }
+    if (!lnode_set(v, (lins){LOP_FOLD, v->count-1, deopts, x, f->buildin}))
+        return NULL;
+    lnodes.folds++;
+    return v->code->ins[0].v;
+}
+
+/* the values a node holds apart from v: the value of a fold */
+static void lnode_trace(lval* v)
+{
+    if (v->code && v->code->ins[0].op == LOP_FOLD)
+        lgc_mark(v->code->ins[0].v);
+}
+
+#define LVM_TOP(i) ((lval*)gc.vals.items[gc.vals.count-1-(i)])
+
+/*
+ * The value of the local of pc, in the frame of the call running when
+ * it is the one of its address, see lenv_slot.
+ */
+static inline lval* lvm_local(lenv* e, lins* pc)
+{
+    if (pc->a == 0)
+    {
+        e = lenv_fwd(e);
+        if (pc->b < e->count && e->syms[pc->b] == pc->v->sym)
+            return e->vals[pc->b];
+    }
+    return lenv_get(e, pc->v);
+}
+
+/* the value of the global k, from the slot cached in it, see lenv_get */
+static inline lval* lvm_global(lenv* e, lval* k)
+{
+    if (k->slot >= 0 && k->slot < lenv_globals->count
+        && lenv_globals->syms[k->slot] == k->sym)
+        return lenv_globals->vals[k->slot];
+    return lenv_get(e, k);
+}
+
+/* call the top n values of the stack, which are popped */
+static lval* lvm_call(lenv* e, int n)
+{
+    lval* f = LVM_TOP(n-1);
+    if (lval_type(f) != LVAL_FUN)
+        return lval_err("first emlempent is not a function!");
+
+    //a lambda given all of its arguments: its frame is made from the
+    //stack, without the S-expr of the call
+    if (!f->buildin && f->env && f->formals->count == n-1 && !ljit_enabled)
+    {
+        lenv* frame = lenv_frame(f->env, n-1);
+        lval** args = (lval**)&gc.vals.items[gc.vals.count-(n-1)];
+        for (int i=0; i<n-1; i++)
+            lenv_put(frame, f->formals->cell[i], args[i]);
+        lgc_pop_vals(n);
+        return lval_tail(frame, f->body);
+    }
+
+    lval* a = lval_sexpr();
+    lval_append(a, (lval**)&gc.vals.items[gc.vals.count-n], n);
+    lgc_pop_vals(n);
+    lgc_push_val(a);
+    lval* x = lval_call(e, a->cell[0], a);
+    lgc_pop_vals(1);
+    return x;
+}
+
+/* call the form v, its function on the top of the stack is popped */
+static lval* lvm_form(lenv* e, lval* v)
+{
+    lbuildin f = LVM_TOP(0)->buildin;
+    lgc_pop_vals(1);
+    return f(e, v);
+}
+
+static inline lcode* lvm_code(lval* body)
+{
+    if (!body->code)
+        body->code = lvm_compile(body, 1);
+    return body->code;
+}
+
+/*
+ * The callers of the running code, in the same lvm_run. Their env and
+ * body are on the root stacks: the env of a frame at envs.items[frame],
+ * its body at vals.items[base-1], and its values above.
+ */
+typedef struct lvm_frame {
+    lcode* c;
+    lins* pc;
+    int frame;
+    int base;
+} lvm_frame;
+
+static __thread struct {
+    lvm_frame* items;
+    int count;
+    int cap;
+} lvm_frames;
+
+static void lvm_frame_push(lcode* c, lins* pc, int frame, int base)
+{
+    if (lvm_frames.count == lvm_frames.cap)
+    {
+        lvm_frames.cap = lvm_frames.cap ? lvm_frames.cap*2 : 64;
+        lvm_frames.items = realloc(lvm_frames.items, lvm_frames.cap * sizeof(lvm_frame));
+    }
+    lvm_frames.items[lvm_frames.count++] = (lvm_frame){c, pc, frame, base};
+}
+
+/*
+ * Run c in e, c is the code of body, if any. A lambda called from the
+ * code runs in the same loop, pushing a frame, or replacing the running
+ * code for a call in tail position.
+ */
+static lval* lvm_run(lenv* e, lval* body, lcode* c)
+{
+    int entry = lvm_frames.count;
+    lgc_push_env(e);
+    lgc_push_val(body);
+    lgc_safepoint();
+    int frame = gc.envs.count-1;
+    int base = gc.vals.count;
+
+    lval* x = NULL;
+    for (lins* pc = c->ins; ; pc++)
+    {
+        switch (pc->op)
+        {
+        case LOP_CONST:
+            lgc_push_val(pc->v);
+            continue;
+        case LOP_NIL:
+            lgc_push_val(lval_sexpr());
+            continue;
+        case LOP_LOCAL:
+            x = lvm_local(e, pc);
+            lgc_push_val(x);
+            break;
+        case LOP_GLOBAL:
+            x = lvm_global(e, pc->v);
+            lgc_push_val(x);
+            break;
+        case LOP_PRIM:
+            if (lispy_is(LVM_TOP(2), pc->f)
+                && (x = lvm_arith(pc->f, LVM_TOP(1), LVM_TOP(0))))
+            {
+                lgc_pop_vals(3);
+                lgc_push_val(x);
+                continue;
+            }
+            //fall through
+        case LOP_CALL:
+            x = pc->v ? lvm_form(e, pc->v) : lvm_call(e, pc->a);
+            if (x == LVAL_TAIL)
+            {
+                if (!lvm_body(ltail.body))
+                {
+                    x = lval_eval_body(ltail.e, ltail.body);
+                    if (!pc->b)
+                        x = lval_nontail(x);
+                    lgc_push_val(x);
+                    break;
+                }
+                if (pc->b)
+                {
+                    gc.vals.count = base;
+                    gc.envs.items[frame] = ltail.e;
+                    gc.vals.items[base-1] = ltail.body;
+                }
+                else
+                {
+                    lvm_frame_push(c, pc, frame, base);
+                    lgc_push_env(ltail.e);
+                    lgc_push_val(ltail.body);
+                    frame = gc.envs.count-1;
+                    base = gc.vals.count;
+                }
+                e = ltail.e;
+                c = lvm_code(ltail.body);
+                pc = c->ins - 1;
+                lgc_safepoint();
+                continue;
+            }
+            if (!pc->b)
+                x = lval_nontail(x);
+            lgc_push_val(x);
+            break;
+        case LOP_FOLDED:
+            if ((x = lnode_fold(e, pc->v)))
+            {
+                lgc_push_val(x);
+                pc = c->ins + pc->a - 1;
+            }
+            continue;
+        case LOP_FORM:
+            if (lval_is_form(LVM_TOP(0)))
+                pc = c->ins + pc->a - 1;
+            continue;
+        case LOP_GUARD:
+            x = LVM_TOP(0);
+            if (lval_type(x) != LVAL_FUN || x->buildin != pc->f)
+                pc = c->ins + pc->a - 1;
+            continue;
+        case LOP_BRANCH:
+            x = LVM_TOP(0);
+            if (lval_type(x) != LVAL_NUM)
+            {
+                pc = c->ins + pc->b - 1;
+                continue;
+            }
+            lgc_pop_vals(2);
+            if (!lval_numval(x))
+                pc = c->ins + pc->a - 1;
+            continue;
+        case LOP_JUMP:
+            pc = c->ins + pc->a - 1;
+            continue;
+        case LOP_RET:
+            x = LVM_TOP(0);
+            if (lvm_frames.count == entry)
+                goto out;
+
+            //back to the caller
+            gc.vals.count = base-1;
+            gc.envs.count = frame;
+            lvm_frame* f = &lvm_frames.items[--lvm_frames.count];
+            c = f->c;
+            pc = f->pc;
+            frame = f->frame;
+            base = f->base;
+            e = gc.envs.items[frame];
+            lgc_push_val(x);
+            continue;
+        }
+
+        if (lval_type(x) == LVAL_ERR)
+            goto out;
+    }
+
+out:
+    //an error aborts the callers too, which a recur can't
+    if (lvm_frames.count > entry)
+    {
+        x = lval_nontail(x);
+        frame = lvm_frames.items[entry].frame;
+        base = lvm_frames.items[entry].base;
+        lvm_frames.count = entry;
+    }
+    gc.vals.count = base-1;
+    gc.envs.count = frame;
+    return x;
+}
+
+/*
+ * JIT: a lambda called LJIT_HOT times is compiled to x86-64 code when its
+ * body is numeric: numbers, its formals, the arithmetic and comparison
+ * builtins, `if', calls of itself by its global name and calls folded to
+ * a number, see lnode_fold. The code works
+ * on longs and is only entered with fixnum arguments. It bails out on an
+ * overflow, a division by zero or a recursion deeper than LJIT_DEPTH, and
+ * the interpreter then runs the call again from the start, which is safe
+ * as such a body has no side effect. The names the code calls are checked
+ * on every entry to still be bound to what it was compiled for, like the
+ * fast paths of the VM.
+ *
+ * The code of a body is kept in a table, with the count of its calls, and
+ * goes with it: see lgc_finalize. The table and the bailout state are
+ * per thread, like the heap the bodies live in. Only Linux on x86-64,
+ * with --jit.
+ */
+#if defined(__x86_64__) && defined(__linux__)
+
+#define LJIT_HOT 64
+#define LJIT_DEPTH 10000
+#define LJIT_GUARDS 16
+#define LJIT_BAILS 8   //then it is left to the interpreter
+#define LJIT_ARGS 6    //passed in registers
+
+typedef long (*ljit_fn)(long, long, long, long, long, long);
+
+typedef struct ljit ljit;
+struct ljit {
+    lval* body;
+    lval* formals; //the code is for those
+    ljit* next;
+    int calls;
+    int bails;
+    ljit_fn fn;    //NULL until compiled
+    void* code;    //the pages of fn
+    size_t size;
+    int nguards;
+    struct {
+        lval* sym;
+        int slot;          //in lenv_globals
+        lbuildin buildin;  //NULL: the lambda itself
+    } guards[LJIT_GUARDS];
+};
+
+static __thread struct {
+    ljit** buckets;
+    int count;
+    int cap; //power of 2
+} ljits;
+
+static __thread jmp_buf ljit_jmp;
+static __thread long ljit_depth;
+
+static void ljit_bail(void)
+{
+    longjmp(ljit_jmp, 1);
+}
+
+static ljit** ljit_find(lval* body)
+{
+    ljit** p = &ljits.buckets[larena_hash(body) & (ljits.cap-1)];
+    while (*p && (*p)->body != body)
+        p = &(*p)->next;
+    return p;
+}
+
+static ljit* ljit_get(lval* body)
+{
+    if (body->gc & LGC_JIT)
+        return *ljit_find(body);
+
+    if (ljits.count >= ljits.cap)
+    {
+        ljit** old = ljits.buckets;
+        int old_cap = ljits.cap;
+        ljits.cap = old_cap ? old_cap*2 : 64;
+        ljits.buckets = calloc(ljits.cap, sizeof(ljit*));
+        for (int i=0; i<old_cap; i++)
+        {
+            for (ljit* j = old[i], *next; j; j = next)
+            {
+                next = j->next;
+                ljit** p = ljit_find(j->body);
+                j->next = *p;
+                *p = j;
+            }
+        }
+        free(old);
+    }
+
+    ljit* j = calloc(1, sizeof(ljit));
+    j->body = body;
+    ljit** p = ljit_find(body);
+    j->next = *p;
+    *p = j;
+    ljits.count++;
+    body->gc |= LGC_JIT;
+    return j;
+}
+
+static void ljit_forget(lval* body)
+{
+    ljit** p = ljit_find(body);
+    ljit* j = *p;
+    *p = j->next;
+    ljits.count--;
+    if (j->code)
+        munmap(j->code, j->size);
+    free(j);
+    body->gc &= ~LGC_JIT;
+}
+
+/* the code being emitted */
+typedef struct ljit_asm {
+    unsigned char* b;
+    int count;
+    int cap;
+    ljit* j;
+    int argc;
+    int entry; //offsets of the function and of its body
+    int start;
+} ljit_asm;
+
+static void ljit_bytes(ljit_asm* a, const void* bytes, int n)
+{
+    if (a->count + n > a->cap)
+    {
+        a->cap = lgc_cap(a->cap, a->count + n);
+        a->b = realloc(a->b, a->cap);
+    }
+    memcpy(a->b + a->count, bytes, n);
+    a->count += n;
+}
+
+#define LJIT_EMIT(a, ...) \
+    ljit_bytes(a, (unsigned char[]){__VA_ARGS__}, sizeof((unsigned char[]){__VA_ARGS__}))
+
+static void ljit_int(ljit_asm* a, int32_t x)   { ljit_bytes(a, &x, 4); }
+static void ljit_long(ljit_asm* a, int64_t x)  { ljit_bytes(a, &x, 8); }
+
+/* the rel32 at `at' goes to target */
+static void ljit_patch(ljit_asm* a, int at, int target)
+{
+    int32_t rel = target - (at + 4);
+    memcpy(a->b + at, &rel, 4);
+}
+
+/* jcc (0x80 | cc), or jmp when cc is -1, to target; where to patch it */
+static int ljit_jump(ljit_asm* a, int cc, int target)
+{
+    if (cc < 0)
+        LJIT_EMIT(a, 0xe9);
+    else
+        LJIT_EMIT(a, 0x0f, 0x80 | cc);
+    int at = a->count;
+    ljit_int(a, 0);
+    ljit_patch(a, at, target);
+    return at;
+}
+
+enum {LJIT_O = 0x0, LJIT_E = 0x4, LJIT_NE = 0x5, LJIT_L = 0xc, LJIT_GE = 0xd,
+      LJIT_LE = 0xe, LJIT_G = 0xf};
+
+/* mov rax, [rbp - 8*(i+1)]; the slot of formal i */
+static void ljit_load(ljit_asm* a, int i)
+{
+    LJIT_EMIT(a, 0x48, 0x8b, 0x85);
+    ljit_int(a, -8*(i+1));
+}
+
+/* mov [rbp - 8*(i+1)], reg */
+static void ljit_store(ljit_asm* a, int i, int reg)
+{
+    LJIT_EMIT(a, 0x48 | (reg >= 8 ? 4 : 0), 0x89, 0x85 | (reg & 7) << 3);
+    ljit_int(a, -8*(i+1));
+}
+
+//the registers of the arguments: rdi, rsi, rdx, rcx, r8, r9
+static const int ljit_regs[LJIT_ARGS] = {7, 6, 2, 1, 8, 9};
+
+/* the name k, bound to the builtin b or to the lambda, is checked on entry */
+static int ljit_guard(ljit_asm* a, lval* k, int slot, lbuildin b)
+{
+    ljit* j = a->j;
+    for (int i=0; i<j->nguards; i++)
+        if (j->guards[i].sym == k)
+            return 1;
+    if (j->nguards == LJIT_GUARDS)
+        return 0;
+    j->guards[j->nguards].sym = k;
+    j->guards[j->nguards].slot = slot;
+    j->guards[j->nguards].buildin = b;
+    j->nguards++;
+    return 1;
+}
+
+static int ljit_expr(ljit_asm* a, lval* x, int tail);
+static int ljit_sexpr(ljit_asm* a, lval* v, int tail);
+
+/* the value of the builtin b on the arguments of v, in rax */
+static int ljit_op(ljit_asm* a, lbuildin b, lval* v)
+{
+    int cc = -1;
+    if (b == buildin_gt) cc = LJIT_G;
+    else if (b == buildin_lt) cc = LJIT_L;
+    else if (b == buildin_ge) cc = LJIT_GE;
+    else if (b == buildin_le) cc = LJIT_LE;
+    else if (b == buildin_eq) cc = LJIT_E;
+    else if (b == buildin_ne) cc = LJIT_NE;
+    else if (b != buildin_add && b != buildin_sub && b != buildin_mul && b != buildin_div)
+        return 0;
+    if (cc >= 0 && v->count != 3)
+        return 0;
+
+    if (!ljit_expr(a, v->cell[1], 0))
+        return 0;
+    for (int i=2; i<v->count; i++)
+    {
+        LJIT_EMIT(a, 0x50);                          //push rax
+        if (!ljit_expr(a, v->cell[i], 0))
+            return 0;
+        LJIT_EMIT(a, 0x48, 0x89, 0xc1, 0x58);        //mov rcx, rax; pop rax
+        if (cc >= 0)
+        {
+            LJIT_EMIT(a, 0x48, 0x39, 0xc8);          //cmp rax, rcx
+            LJIT_EMIT(a, 0x0f, 0x90 | cc, 0xc0);     //setcc al
+            LJIT_EMIT(a, 0x0f, 0xb6, 0xc0);          //movzx eax, al
+        }
+        else if (b == buildin_div)
+        {
+            LJIT_EMIT(a, 0x48, 0x85, 0xc9);          //test rcx, rcx
+            ljit_jump(a, LJIT_E, 0);
+            LJIT_EMIT(a, 0x48, 0x83, 0xf9, 0xff);    //cmp rcx, -1
+            int skip = ljit_jump(a, LJIT_NE, 0);
+            LJIT_EMIT(a, 0x48, 0xba);                //mov rdx, LONG_MIN
+            ljit_long(a, LONG_MIN);
+            LJIT_EMIT(a, 0x48, 0x39, 0xd0);          //cmp rax, rdx
+            ljit_jump(a, LJIT_E, 0);
+            ljit_patch(a, skip, a->count);
+            LJIT_EMIT(a, 0x48, 0x99, 0x48, 0xf7, 0xf9); //cqo; idiv rcx
+        }
+        else
+        {
+            if (b == buildin_add)
+                LJIT_EMIT(a, 0x48, 0x01, 0xc8);      //add rax, rcx
+            else if (b == buildin_sub)
+                LJIT_EMIT(a, 0x48, 0x29, 0xc8);      //sub rax, rcx
+            else
+                LJIT_EMIT(a, 0x48, 0x0f, 0xaf, 0xc1); //imul rax, rcx
+            ljit_jump(a, LJIT_O, 0);
+        }
+    }
+    return 1;
+}
+
+/* (if cond {then} {else}) */
+static int ljit_if(ljit_asm* a, lval* v, int tail)
+{
+    if (v->count != 4 || lval_type(v->cell[2]) != LVAL_QEXPR
+        || lval_type(v->cell[3]) != LVAL_QEXPR)
+        return 0;
+    if (!ljit_expr(a, v->cell[1], 0))
+        return 0;
+    LJIT_EMIT(a, 0x48, 0x85, 0xc0);                  //test rax, rax
+    int other = ljit_jump(a, LJIT_E, 0);
+    if (!ljit_sexpr(a, v->cell[2], tail))
+        return 0;
+    int end = ljit_jump(a, -1, 0);
+    ljit_patch(a, other, a->count);
+    if (!ljit_sexpr(a, v->cell[3], tail))
+        return 0;
+    ljit_patch(a, end, a->count);
+    return 1;
+}
+
+/* a call of the lambda itself, a jump to its body in tail position */
+static int ljit_self(ljit_asm* a, lval* v, int tail)
+{
+    if (v->count-1 != a->argc)
+        return 0;
+    for (int i=1; i<v->count; i++)
+    {
+        if (!ljit_expr(a, v->cell[i], 0))
+            return 0;
+        LJIT_EMIT(a, 0x50);                          //push rax
+    }
+    for (int i=a->argc-1; i>=0; i--)
+    {
+        if (tail)
+        {
+            LJIT_EMIT(a, 0x58);                      //pop rax
+            ljit_store(a, i, 0);
+        }
+        else if (ljit_regs[i] >= 8)
+            LJIT_EMIT(a, 0x41, 0x58 | (ljit_regs[i] & 7)); //pop r8/r9
+        else
+            LJIT_EMIT(a, 0x58 | ljit_regs[i]);       //pop reg
+    }
+    if (tail)
+    {
+        ljit_jump(a, -1, a->start);
+        return 1;
+    }
+    LJIT_EMIT(a, 0xe8);                              //call entry
+    int at = a->count;
+    ljit_int(a, 0);
+    ljit_patch(a, at, a->entry);
+    return 1;
+}
+
+/* the heads of the call on constants v and of those among its operands */
+static int ljit_fold_guards(ljit_asm* a, lval* v)
+{
+    lval* k = v->cell[0];
+    int slot = lenv_find(lenv_globals, k->sym);
+    if (slot < 0 || lval_type(lenv_globals->vals[slot]) != LVAL_FUN
+        || !ljit_guard(a, k, slot, lenv_globals->vals[slot]->buildin))
+        return 0;
+    for (int i=1; i<v->count; i++)
+        if (lval_type(v->cell[i]) == LVAL_SEXPR && !ljit_fold_guards(a, v->cell[i]))
+            return 0;
+    return 1;
+}
+
+/* the cells of v run as an S-expr, the value in rax */
+static int ljit_sexpr(ljit_asm* a, lval* v, int tail)
+{
+    if (v->count == 1)
+        return ljit_expr(a, v->cell[0], tail);
+
+    //a call folded to a number, as long as its builtins are those
+    lval* x = v->gc & LGC_CONST ? lnode_fold(lenv_globals, v) : NULL;
+    if (x && lval_is_fixnum(x) && ljit_fold_guards(a, v))
+    {
+        LJIT_EMIT(a, 0x48, 0xb8);                    //mov rax, imm64
+        ljit_long(a, lval_numval(x));
+        return 1;
+    }
+
+    lval* k = v->count ? v->cell[0] : NULL;
+    if (!k || lval_type(k) != LVAL_SYM || k->depth >= 0)
+        return 0;
+    int slot = lenv_find(lenv_globals, k->sym);
+    if (slot < 0)
+        return 0;
+    lval* f = lenv_globals->vals[slot];
+    if (lval_type(f) != LVAL_FUN)
+        return 0;
+    if (!f->buildin && (f->env != lenv_globals || f->body != a->j->body
+                        || f->formals != a->j->formals))
+        return 0;
+    if (!ljit_guard(a, k, slot, f->buildin))
+        return 0;
+
+    if (!f->buildin)
+        return ljit_self(a, v, tail);
+    if (f->buildin == buildin_if)
+        return ljit_if(a, v, tail);
+    return ljit_op(a, f->buildin, v);
+}
+
+static int ljit_expr(ljit_asm* a, lval* x, int tail)
+{
+    switch (lval_type(x))
+    {
+    case LVAL_NUM:
+        LJIT_EMIT(a, 0x48, 0xb8);                    //mov rax, imm64
+        ljit_long(a, lval_numval(x));
+        return 1;
+    case LVAL_SYM:
+        //a formal of the lambda, resolved for these formals
+        if (x->depth != 0 || x->slot >= a->argc
+            || a->j->formals->cell[x->slot]->sym != x->sym)
+            return 0;
+        ljit_load(a, x->slot);
+        return 1;
+    case LVAL_SEXPR:
+        return ljit_sexpr(a, x, tail);
+    }
+    return 0;
+}
+
+/* compile the lambda f of the entry j */
+static int ljit_compile(ljit* j, lval* f)
+{
+    lval* formals = f->formals;
+    if (formals->count > LJIT_ARGS)
+        return 0;
+    for (int i=0; i<formals->count; i++)
+        for (int k=0; k<i; k++)
+            if (formals->cell[i]->sym == formals->cell[k]->sym)
+                return 0;
+
+    ljit_asm a = {NULL, 0, 0, j, formals->count, 0, 0};
+    j->formals = formals;
+    j->nguards = 0;
+
+    //the bail out, at 0 for the jumps to it
+    LJIT_EMIT(&a, 0x48, 0x83, 0xe4, 0xf0);           //and rsp, -16
+    LJIT_EMIT(&a, 0x48, 0xb8);                       //mov rax, ljit_bail
+    ljit_long(&a, (intptr_t)ljit_bail);
+    LJIT_EMIT(&a, 0xff, 0xd0);                       //call rax
+
+    a.entry = a.count;
+    LJIT_EMIT(&a, 0x55, 0x48, 0x89, 0xe5);           //push rbp; mov rbp, rsp
+    LJIT_EMIT(&a, 0x48, 0x81, 0xec);                 //sub rsp, 8*argc
+    ljit_int(&a, 8*a.argc);
+    for (int i=0; i<a.argc; i++)
+        ljit_store(&a, i, ljit_regs[i]);
+    LJIT_EMIT(&a, 0x48, 0xb9);                       //mov rcx, &ljit_depth
+    ljit_long(&a, (intptr_t)&ljit_depth);
+    LJIT_EMIT(&a, 0x48, 0xff, 0x01);                 //inc qword [rcx]
+    LJIT_EMIT(&a, 0x48, 0x81, 0x39);                 //cmp qword [rcx], LJIT_DEPTH
+    ljit_int(&a, LJIT_DEPTH);
+    ljit_jump(&a, LJIT_G, 0);
+
+    a.start = a.count;
+    int ok = ljit_sexpr(&a, f->body, 1);
+    LJIT_EMIT(&a, 0x48, 0xb9);                       //mov rcx, &ljit_depth
+    ljit_long(&a, (intptr_t)&ljit_depth);
+    LJIT_EMIT(&a, 0x48, 0xff, 0x09);                 //dec qword [rcx]
+    LJIT_EMIT(&a, 0xc9, 0xc3);                       //leave; ret
+
+    if (ok)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        j->size = (a.count + page-1) / page * page;
+        j->code = mmap(NULL, j->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (j->code == MAP_FAILED)
+            j->code = NULL;
+        else
+        {
+            memcpy(j->code, a.b, a.count);
+            mprotect(j->code, j->size, PROT_READ | PROT_EXEC);
+            j->fn = (ljit_fn)((char*)j->code + a.entry);
+        }
+    }
+    free(a.b);
+    return j->fn != NULL;
+}
+
+/* the call of the lambda f on the arguments a in native code, NULL if not */
+static lval* ljit_call(lval* f, lval* a)
+{
+    lval* body = f->body;
+    if (body->gc & LGC_NOJIT || f->env != lenv_globals || larena_has(body))
+        return NULL;
+
+    ljit* j = ljit_get(body);
+    if (!j->fn)
+    {
+        if (++j->calls < LJIT_HOT)
+            return NULL;
+        if (!ljit_compile(j, f))
+        {
+            ljit_forget(body);
+            body->gc |= LGC_NOJIT;
+            return NULL;
+        }
+    }
+    if (f->formals != j->formals)
+        return NULL;
+
+    long x[LJIT_ARGS] = {0};
+    for (int i=1; i<a->count; i++)
+    {
+        if (!lval_is_fixnum(a->cell[i]))
+            return NULL;
+        x[i-1] = lval_numval(a->cell[i]);
+    }
+    for (int i=0; i<j->nguards; i++)
+    {
+        int slot = j->guards[i].slot;
+        if (slot >= lenv_globals->count
+            || lenv_globals->syms[slot] != j->guards[i].sym->sym)
+            return NULL;
+        lval* g = lenv_globals->vals[slot];
+        if (lval_type(g) != LVAL_FUN || g->buildin != j->guards[i].buildin)
+            return NULL;
+        if (!g->buildin && (g->env != lenv_globals || g->body != body
+                            || g->formals != j->formals))
+            return NULL;
+    }
+
+    ljit_depth = 0;
+    if (setjmp(ljit_jmp))
+    {
+        if (++j->bails == LJIT_BAILS)
+        {
+            ljit_forget(body);
+            body->gc |= LGC_NOJIT;
+        }
+        return NULL;
+    }
+    return lval_num(j->fn(x[0], x[1], x[2], x[3], x[4], x[5]));
+}
+
+#else
+
+static void ljit_forget(lval* body)
+{
+}
+
+static lval* ljit_call(lval* f, lval* a)
+{
+    return NULL;
+}
+
+#endif
+
+/* evaluate the body of a lambda in its frame e */
+lval* lval_eval_body(lenv* e, lval* body)
+{
+    for (lbuildin f; (f = lval_native(body)); e = ltail.e, body = ltail.body)
+    {
+        lnative_depth++;
+        lval* x = f(e, body);
+        lnative_depth--;
+        if (x != LVAL_TAIL)
+            return x;
+    }
+
+    if (lvm_body(body))
+        return lvm_run(e, body, lvm_code(body));
+
+    return lval_run(e, body, 1);
+}
+
+/* evaluate a top-level form */
+lval* lval_eval_form(lenv* e, lval* v)
+{
+    if (!lvm_enabled)
+        return lval_eval(e, v);
+
+    lgc_push_val(v);
+    lcode* c = lvm_compile(v, 0);
+    lval* x = lvm_run(e, NULL, c);
+    lvm_free(c);
+    lgc_pop_vals(1);
+    return x;
+}
+
+/* evaluate the forms, each in an arena of its own, printing their values */
+lval* lispy_eval_forms(lenv* e, lval* forms)
+{
+    lgc_push_val(forms);
+    for (int i=0; i<forms->count; i++)
+    {
+        larena_begin();
+        lval* x = lval_eval_form(e, forms->cell[i]);
+        lval_println(x);
+        larena_end();
+    }
+    lgc_pop_vals(1);
+
+    return lval_sexpr();
+}
+
+int lispy_option(const char* opt)
+{
+    if (!strcmp(opt, "--gc=incremental"))
+        gc.incremental = 1;
+    else if (!strcmp(opt, "--gc=stop-the-world"))
+        gc.incremental = 0;
+    else if (!strncmp(opt, "--gc-budget=", 12))
+        gc.budget_us = atol(opt+12);
+    else if (!strcmp(opt, "--vm"))
+        lvm_enabled = 1;
+    else if (!strcmp(opt, "--jit"))
+        ljit_enabled = 1;
+    else
+        return 0;
+    return 1;
+}
+
+/* the global env */
+lenv* lispy_init(void)
+{
+    lenv *e = lenv_new();
+    lgc_push_env(e); //the global env is always a root
+    lenv_globals = e;
+    lenv_add_buildins(e);
+    return e;
+}
+
+/*
+ * The runtime of the C generated by --compile, see main.c. A compiled
+ * body runs on the root stacks like lvm_run: its env is pushed by
+ * lispy_enter, the values of the calls being evaluated by lispy_push,
+ * and lispy_leave unwinds them.
+ */
+
+/* a value of the code, rooted for good: made before anything runs */
+lval* lispy_const(lval* x)
+{
+    lgc_push_val(x);
+    return x;
+}
+
+/* attach f, the compiled code of body, run by lval_eval_body */
+void lispy_native(lval* body, lbuildin f)
+{
+    lcode* c = malloc(sizeof(lcode) + sizeof(lins));
+    c->count = 1;
+    c->cap = 1;
+    c->ins[0] = (lins){LOP_NATIVE, 0, 0, NULL, f};
+    if (body->code)
+        lvm_free(body->code);
+    body->code = c;
+    body->gc |= LGC_RESOLVED; //the code is of these cells, as they are
+}
+
+/* the value of the call on constants v, NULL if it doesn't fold, see lnode_fold */
+lval* lispy_fold(lenv* e, lval* v)
+{
+    return lnode_fold(e, v);
+}
+
+/* run a compiled top-level form, as load does */
+void lispy_run(lenv* e, lbuildin form)
+{
+    larena_begin();
+    lval_println(form(e, NULL));
+    larena_end();
+}
+
+int lispy_enter(lenv* e)
+{
+    lgc_push_env(e);
+    lgc_safepoint();
+    return gc.vals.count;
+}
+
+lval* lispy_leave(int sp, lval* x)
+{
+    gc.vals.count = sp;
+    lgc_pop_envs(1);
+    return x;
+}
+
+void lispy_push(lval* x)
+{
+    lgc_push_val(x);
+}
+
+void lispy_pop(int n)
+{
+    lgc_pop_vals(n);
+}
+
+lval* lispy_top(int i)
+{
+    return LVM_TOP(i);
+}
+
+/* the value of k, a formal at the lexical address depth, slot */
+lval* lispy_local(lenv* e, lval* k, int depth, int slot)
+{
+    lval** x = lenv_slot(e, k->sym, depth, slot);
+    return x ? *x : lenv_get(e, k);
+}
+
+/* the value of k, which no formal around it binds, see lenv_get */
+lval* lispy_global(lenv* e, lval* k)
+{
+    if (k->slot >= 0 && k->slot < lenv_globals->count
+        && lenv_globals->syms[k->slot] == k->sym)
+        return lenv_globals->vals[k->slot];
+    return lenv_get(e, k);
+}
+
+/* the fast path of the arithmetic builtin f, NULL if it doesn't apply */
+lval* lispy_arith(lval* f, lval* x, lval* y)
+{
+    if (lval_type(f) != LVAL_FUN || !f->buildin)
+        return NULL;
+    return lvm_arith(f->buildin, x, y);
+}
+
+/* call the form v, its function on the top is popped, as lispy_apply */
+lval* lispy_form(lenv* e, lval* v, int tail)
+{
+    lgc_safepoint();
+    lval* x = lvm_form(e, v);
+    if (x == LVAL_TAIL && !tail)
+        x = lval_eval_body(ltail.e, ltail.body);
+    return tail ? x : lval_nontail(x);
+}
+
+/* call the top n values, in tail position if tail is set */
+lval* lispy_apply(lenv* e, int n, int tail)
+{
+    lval* f = LVM_TOP(n-1);
+    lval* x;
+    if (n == 3 && lval_type(f) == LVAL_FUN && f->buildin
+        && (x = lvm_arith(f->buildin, LVM_TOP(1), LVM_TOP(0))))
+    {
+        lgc_pop_vals(3);
+        return x;
+    }
+
+    lgc_safepoint();
+    x = lvm_call(e, n);
+    if (x == LVAL_TAIL && !tail)
+        x = lval_eval_body(ltail.e, ltail.body);
+    return tail ? x : lval_nontail(x);
+}
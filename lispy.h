@@ -0,0 +1,153 @@
+#ifndef LISPY_H
+#define LISPY_H
+
+#include <stdint.h>
+#include <limits.h>
+
+/*
+ * The runtime of the interpreter, lispy.c: the values, the environments
+ * and the evaluators. It is used by the interpreter, main.c, which adds
+ * the reader, `load' and the REPL, and by the C the compiler generates,
+ * see lispy_native, which only needs lispy.c.
+ */
+
+struct lenv;
+struct lval;
+
+typedef struct lenv lenv;
+typedef struct lval lval;
+typedef lval* (*lbuildin)(lenv*, lval*);
+typedef struct lcode lcode;
+
+/* only the payload of `type' is valid, so the variants share storage */
+struct lval {
+    unsigned char gc;
+    unsigned char level; //arena level, 0 for the heap
+    unsigned char type;
+
+    union {
+        //for basic
+        long num; //boxed, only for numbers which don't fit in a fixnum
+        char* err;
+        char* str;
+
+        //for Symbol
+        struct {
+            char* sym; //interned
+            int depth; //lexical address, -1 if none, see lval_resolve
+            int slot;  //interned: the global binding, see lenv_get
+        };
+
+        //for Function
+        struct {
+            lbuildin buildin; //NULL: lambda, non-null: buildin function
+            union {
+                lenv* env;    //NULL: a partial application, see lval_partial
+                int form;     //a buildin: a special form, see lval_form_arg
+            };
+            union {lval* formals; lval* fn;};   //fn: the lambda applied
+            union {lval* body; lval* args;};    //args: the arguments so far
+        };
+
+        //for S-expr
+        struct {
+            int count;
+            int cap;      //0 for a view
+            lval** cell;
+            lval* base;   //a view: the owner of the cells, see lval_view
+            lcode* code;  //compiled, see lvm_run
+        };
+    };
+};
+
+enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR,
+      LVAL_BUF}; //cells shared by Q-expr views, never a value
+
+/*
+ * Fixnum: a number stored in the lval pointer itself, tagged by the low
+ * bit which is always clear for a real (aligned) lval. They are never
+ * allocated, so the collector skips them.
+ */
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+
+static inline int lval_is_fixnum(lval* v)
+{
+    return (intptr_t)v & 1;
+}
+
+static inline int lval_type(lval* v)
+{
+    return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_numval(lval* v)
+{
+    return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+/* a buildin given the cells of the call instead of their values */
+static inline int lval_is_form(lval* v)
+{
+    return lval_type(v) == LVAL_FUN && v->buildin && v->form;
+}
+
+lval* lval_err(char* fmt, ...);
+lval* lval_num(long n);
+lval* lval_sym(char* str);
+lval* lval_str(char* str);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_add(lval* v, lval* x);
+void lval_print(lval* v);
+void lval_println(lval* v);
+char* ltype_name(int type);
+
+lenv* lenv_new(void);
+lval* lenv_get(lenv* e, lval* k);
+void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_def(lenv* e, lval* k, lval* v);
+void lenv_add_buildin(lenv* e, char* name, lbuildin func);
+int lval_is_fold(lval* v);
+
+lval* lval_eval_form(lenv* e, lval* v);
+lval* lval_eval_body(lenv* e, lval* body);
+lval* buildin_if(lenv* e, lval* v);
+lval* buildin_add(lenv* e, lval* v);
+lval* buildin_sub(lenv* e, lval* v);
+lval* buildin_mul(lenv* e, lval* v);
+lval* buildin_div(lenv* e, lval* v);
+lval* buildin_gt(lenv* e, lval* v);
+lval* buildin_lt(lenv* e, lval* v);
+lval* buildin_ge(lenv* e, lval* v);
+lval* buildin_le(lenv* e, lval* v);
+lval* buildin_eq(lenv* e, lval* v);
+lval* buildin_ne(lenv* e, lval* v);
+
+/* the interpreter */
+int lispy_option(const char* opt);
+lenv* lispy_init(void);
+lval* lispy_eval_forms(lenv* e, lval* forms);
+
+/* for the compiled code */
+lval* lispy_const(lval* x);
+void lispy_native(lval* body, lbuildin f);
+void lispy_run(lenv* e, lbuildin form);
+int lispy_enter(lenv* e);
+lval* lispy_leave(int sp, lval* x);
+void lispy_push(lval* x);
+void lispy_pop(int n);
+lval* lispy_top(int i);
+lval* lispy_local(lenv* e, lval* k, int depth, int slot);
+lval* lispy_global(lenv* e, lval* k);
+lval* lispy_arith(lval* f, lval* x, lval* y);
+lval* lispy_fold(lenv* e, lval* v);
+lval* lispy_apply(lenv* e, int n, int tail);
+lval* lispy_form(lenv* e, lval* v, int tail);
+
+static inline int lispy_is(lval* f, lbuildin b)
+{
+    return lval_type(f) == LVAL_FUN && f->buildin == b;
+}
+
+#endif
@@ -1,310 +1,23 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <error.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <editline/readline.h>
 #include <mpc.h>
+#include "lispy.h"
 
-static mpc_parser_t* Lispy;
 char *strdup(const char *s);
 
-struct lenv;
-struct lval;
-
-typedef struct lenv lenv;
-typedef struct lval lval;
-typedef lval* (*lbuildin)(lenv*, lval*);
-
-lenv* lenv_new(void);
-void lenv_del(lenv* e);
-lenv* lenv_copy(lenv* e);
-
-struct lenv {
-    lenv* par;
-    int count;
-    char** syms;
-    lval** vals;
-};
-
-struct lval {
-    int type;
-
-    //for basic
-    long num;
-    char* err;
-    char* sym;
-    char* str;
-
-    //for Function
-    lbuildin buildin; //NULL: lambda, non-null: buildin function
-    lenv* env;
-    lval* formals;
-    lval* body;
-
-    //for S-expr
-    int count;
-    lval** cell;
-};
-
-enum {LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR};
-
-char* ltype_name(int type)
-{
-#define LVAL_TPYE(type)  \
-    case type: return #type;
-
-    switch (type)
-    {
-    LVAL_TPYE(LVAL_ERR);
-    LVAL_TPYE(LVAL_NUM);
-    LVAL_TPYE(LVAL_SYM);
-    LVAL_TPYE(LVAL_STR);
-    LVAL_TPYE(LVAL_FUN);
-    LVAL_TPYE(LVAL_SEXPR);
-    LVAL_TPYE(LVAL_QEXPR);
-    default: return "Unknown";
-    }
-
-}
-
-lval* lval_err(char* fmt, ...)
-{
-    lval *x = malloc(sizeof(lval));
-    x->type = LVAL_ERR;
-    x->err = malloc(512);
-
-    va_list va;
-    va_start(va, fmt);
-    vsnprintf(x->err, 511, fmt, va);
-    va_end(va);
-
-    x->err = realloc(x->err, strlen(x->err)+1);
-
-    return x;
-}
-
-lval* lval_num(long n)
-{
-    lval* x = malloc(sizeof(lval));
-    x->type = LVAL_NUM;
-    x->num = n;
-    return x;
-}
-
-lval* lval_sym(char* str)
-{
-    lval* x = malloc(sizeof(lval));
-    x->type = LVAL_SYM;
-    x->sym = malloc(strlen(str)+1);
-    strcpy(x->sym, str);
-    return x;
-}
-
-lval* lval_str(char* str)
-{
-    lval* x = malloc(sizeof(lval));
-    x->type = LVAL_STR;
-    x->str = strdup(str);
-    return x;
-}
-
-lval* lval_buidin(lbuildin func)
-{
-    lval* x = malloc(sizeof(lval));
-    x->type = LVAL_FUN;
-    x->buildin = func;
-    return x;
-}
-
-lval* lval_lambda(lval* formals, lval* body)
-{
-    lval* x = malloc(sizeof(lval));
-    x->type = LVAL_FUN;
-    x->buildin = NULL;
-    x->env = lenv_new();
-    x->formals = formals;
-    x->body = body;
-
-    return x;
-}
-
-lval* lval_expr(int type)
-{
-    lval* x = malloc(sizeof(lval));
-    x->type = type;
-    x->count = 0;
-    x->cell = NULL;
-    return x;
-}
-
-lval* lval_sexpr(void)
-{
-    return lval_expr(LVAL_SEXPR);
-}
-
-lval* lval_qexpr(void)
-{
-    return lval_expr(LVAL_QEXPR);
-}
-
-void lval_del(lval* v)
-{
-    switch (v->type)
-    {
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_NUM: break;
-    case LVAL_STR: free(v->str); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_FUN:
-        if (v->buildin == NULL) //lambda
-        {
-            lenv_del(v->env);
-            lval_del(v->formals);
-            lval_del(v->body);
-        }
-        break;
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-       for (int i=0; i<v->count; i++)
-       {
-           lval_del(v->cell[i]);
-       }
-       break;
-    }
-
-    free(v);
-}
-
-lval* lval_add(lval* v, lval* x)
-{
-    v->count++;
-    v->cell = realloc(v->cell, v->count * sizeof(lval));
-    v->cell[v->count-1] = x;
-    return v;
-}
-
-//V is an S-Expr or Q-Expr
-//this version is really effectiveless
-lval* lval_copy(lval* v)
-{
-    lval* x = NULL;
-    switch (v->type)
-    {
-    case LVAL_NUM: x = lval_num(v->num); break;
-    case LVAL_ERR:
-       x = malloc(sizeof(lval));
-       x->type = LVAL_ERR;
-       x->err = strdup(v->err);
-       break;
-    case LVAL_SYM: x = lval_sym(v->sym); break;
-    case LVAL_STR: x = lval_str(v->str); break;
-    case LVAL_FUN:
-           x = malloc(sizeof(lval));
-           x->type = v->type;
-           x->buildin = v->buildin;
-           if (!v->buildin)
-           {
-               x->env = lenv_copy(v->env);
-               x->formals = lval_copy(v->formals);
-               x->body = lval_copy(v->body);
-           }
-           break;
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-       x = lval_expr(v->type);
-       for (int i=0; i<v->count; i++)
-       {
-           lval_add(x, lval_copy(v->cell[i]));
-       }
-       break;
-    }
-
-    return x;
-}
-
-lval* lval_clone(lval* v, int i)
-{
-    return lval_copy(v->cell[i]);
-}
-
-lenv* lenv_new(void)
-{
-    lenv* e = malloc(sizeof(lenv));
-    e->par = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    return e;
-}
-
-void lenv_del(lenv* e)
-{
-    for (int i=0; i<e->count; i++)
-    {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
-    }
-
-    free(e->syms);
-    free(e->vals);
-    free(e);
-}
-
-lenv* lenv_copy(lenv* e)
-{
-    lenv* v = malloc(sizeof(lenv));
-    v->par =e->par;
-    v->count = e->count;
-    v->syms = malloc(v->count*sizeof(char*));
-    v->vals = malloc(v->count*sizeof(lval*));
-    for (int i=0; i<v->count; i++)
-    {
-        v->syms[i] = strdup(e->syms[i]);
-        v->vals[i] = lval_copy(e->vals[i]);
-    }
-    return v;
-}
-
-/* k is just the name of val, to find the value of the val in the env */
-lval* lenv_get(lenv* e, lval* k)
-{
-    for (int i=0; i<e->count; i++)
-        if (!strcmp(e->syms[i], k->sym))
-            return lval_copy(e->vals[i]);
-    if (e->par)
-        return lenv_get(e->par, k);
-    return lval_err("unbounded symbol %s", k->sym);
-}
-
-/* k is just the name of val, v is the value of the val*/
-void lenv_put(lenv* e, lval* k, lval* v)
-{
-    for (int i=0; i<e->count; i++)
-    {
-        if (!strcmp(e->syms[i], k->sym))
-        {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return ;
-        }
-    }
-
-    e->count++;
-    e->syms = realloc(e->syms, sizeof(e->syms[0]) * e->count);
-    e->vals = realloc(e->vals, sizeof(e->vals[0]) * e->count);
-    e->syms[e->count-1] = strdup(k->sym);
-    e->vals[e->count-1] = lval_copy(v);
-}
-
-void lenv_def(lenv* e, lval* k, lval* v)
-{
-    while(e->par) e = e->par;
-    lenv_put(e, k, v);
-}
+/*
+ * The reader, and `load' and the REPL which use it. They are only part of
+ * the interpreter: the runtime, and so the compiled programs, don't need
+ * mpc nor readline.
+ */
+static mpc_parser_t* Lispy;
 
-lval* lval_read_str(mpc_ast_t* t)
+static lval* lval_read_str(mpc_ast_t* t)
 {
     /* cut the " at the head/end of the string */
     t->contents[strlen(t->contents)-1] = 0;
@@ -319,13 +32,13 @@ lval* lval_read_str(mpc_ast_t* t)
     return str;
 }
 
-lval* lval_read(mpc_ast_t* t)
+static lval* lval_read(mpc_ast_t* t)
 {
     lval* x = NULL;
     if (strstr(t->tag, "number"))
     {
         errno = 0;
-        int i = strtol(t->contents, NULL, 10);
+        long i = strtol(t->contents, NULL, 10);
         x = errno != ERANGE ? lval_num(i) : lval_err("invalid number!");
         return x;
     }
@@ -359,675 +72,738 @@ lval* lval_read(mpc_ast_t* t)
     return x;
 }
 
-lval* buildin_head(lenv *e, lval* v)
+/* the forms of a file, as a Q-expr */
+static lval* lispy_read_file(const char* filename)
 {
-    if (v->count != 2)
-        return lval_err("Function 'head' passed too many arguments, "
-                        "get %d, expectedd %d", 1, v->count);
-    if (v->cell[1]->type != LVAL_QEXPR)
-        return lval_err("Function 'head' passed incorrect type, "
-                        "get <%s>, expected<%s>",
-                        ltype_name(v->cell[1]->type), ltype_name(LVAL_QEXPR));
-    if (v->cell[1]->count == 0)
-        return lval_err("Function 'head' passed {}!");
+    mpc_result_t r;
+    if (!mpc_parse_contents(filename, Lispy, &r))
+    {
+        //mpc_err_print(r.error);
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        lval* err = lval_err("Could not load Library %s", err_msg);
+        free(err_msg);
+        return err;
+    }
 
-    lval* x = lval_expr(v->cell[1]->type);
-    lval_add(x, lval_clone(v->cell[1], 0));
-    return x;
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    return expr;
 }
 
-lval* buildin_tail(lenv* e, lval* v)
+/* evaluate the forms of a file, printing their values */
+static lval* lispy_load(lenv* e, const char* filename)
 {
-    if (v->count != 2)
-        return lval_err("Function 'tail' passed too many arguments, "
-                        "get %d, expectedd %d", v->count, 1);
-    if (v->cell[1]->type != LVAL_QEXPR)
-        return lval_err("Function 'tail' passed incorrect type, "
-                        "get <%s>, expected<%s>",
-                        ltype_name(v->cell[1]->type), ltype_name(LVAL_QEXPR));
-    if (v->cell[1]->count == 0)
-        return lval_err("Function 'tail' passed {}!");
-
-    lval* x = lval_expr(v->cell[1]->type);
-    for (int i=1; i<v->cell[1]->count; i++)
-        lval_add(x, lval_clone(v->cell[1], i));
-
-    return x;
+    lval* expr = lispy_read_file(filename);
+    if (lval_type(expr) == LVAL_ERR)
+        return expr;
+    return lispy_eval_forms(e, expr);
 }
 
-lval* buildin_list(lenv* e, lval* v)
+static lval* buildin_load(lenv* e, lval* v)
 {
-    lval* x = lval_expr(LVAL_QEXPR);
-    for (int i=1; i<v->count; i++)
-        x = lval_add(x, lval_clone(v, i));
-    return x;
+    if (v->count != 2)
+        return lval_err("Function 'load' passed too many arguments, "
+                        "get %d, expectedd %d", 1, v->count);
+    if (lval_type(v->cell[1]) != LVAL_STR)
+        return lval_err("Function 'load' passed incorrect type, "
+                        "get <%s>, expected<%s>",
+                        ltype_name(lval_type(v->cell[1])), ltype_name(LVAL_STR));
+    return lispy_load(e, v->cell[1]->str);
 }
 
-//x y should be Q-Expr
-lval* lval_join(lval* x, lval* y)
+/* the parser, and the global env with load */
+static lenv* lispy_reader(void)
 {
-    for (int i=0; i<y->count; i++)
-    {
-        x = lval_add(x, lval_clone(y, i));
-    }
+    mpc_parser_t* Number = mpc_new("number");
+    mpc_parser_t* Symbol = mpc_new("symbol");
+    mpc_parser_t* String = mpc_new("string");
+    mpc_parser_t* Comment = mpc_new("comment");
+    mpc_parser_t* Sexpr = mpc_new("sexpr");
+    mpc_parser_t* Qexpr = mpc_new("qexpr");
+    mpc_parser_t* Expr = mpc_new("expr");
+    Lispy = mpc_new("lispy");
 
-    return x;
+    mpca_lang(MPCA_LANG_DEFAULT,                                      \
+        "                                                             \
+            number   : /-?[0-9]+/ ;                                   \
+            symbol   : /[a-zA-Z_0-9+\\-*\\/\\\\=<>!&]+/ ;             \
+            string   : /\"(\\\\.|[^\"])*\"/ ;                         \
+            comment  : /;[^\\r\\n]*/ ;                                 \
+            sexpr    : '(' <expr>* ')' ;                              \
+            qexpr    : '{' <expr>* '}' ;                              \
+            expr     : <number>  | <symbol> | <string> |              \
+                       <comment> | <sexpr>  | <qexpr> ;                           \
+            lispy    : /^/ <expr>* /$/ ;                              \
+        ",                                                            \
+        Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+
+    lenv* e = lispy_init();
+    lenv_add_buildin(e, "load", buildin_load);
+    return e;
 }
 
-lval* buildin_join(lenv* e, lval* v)
+static void lispy_repl(lenv* e)
 {
-    for (int i=1; i<v->count; i++)
+    while (1)
     {
-        if (v->cell[i]->type != LVAL_QEXPR)
-            return lval_err("Function 'join' passed incorrect type!");
-    }
+        char* line = readline("lispy> ");
+        add_history(line);
+        mpc_result_t r;
+        if (mpc_parse("<stdin>", line, Lispy, &r))
+        {
+            mpc_ast_print(r.output);
+            lval* forms = lval_sexpr();
+            lispy_eval_forms(e, lval_add(forms, lval_read(r.output)));
+            mpc_ast_delete(r.output);
+        } else {
+            mpc_err_print(r.error);
+            mpc_err_delete(r.error);
+        }
 
-    lval* x = lval_clone(v, 1);
-    for (int i=2; i<v->count; i++)
-    {
-        lval_join(x, v->cell[i]);
+        free(line);
     }
-
-    return x;
 }
 
-lval* lval_eval(lenv* e, lval* v);
-lval* buildin_eval(lenv* e, lval* v)
-{
-    if (v->count != 2)
-        return lval_err("Function 'eval' passed too many arguments, "
-                        "get %d, expectedd %d", 1, v->count-1);
-    if (v->cell[1]->type != LVAL_QEXPR)
-        return lval_err("Function 'eval' passed incorrect type, "
-                        "get <%s>, expected<%s>",
-                        ltype_name(v->cell[1]->type), ltype_name(LVAL_QEXPR));
-//    if (v->cell[0]->count == 0)
-//        return lval_err("Function 'eval' passed {}!");
-    lval* x = lval_clone(v, 1);
-    x->type = LVAL_SEXPR;
+/*
+ * The compiler, --compile: the forms of a file become C functions run
+ * by the runtime of lispy.c, in place of parsing and evaluating them:
+ *     cc -std=c99 out.c lispy.c -I. -lm
+ * or, with --lib, the code to link into another program, see lcc_file.
+ * The program has no reader, so `load' is unbound there.
+ * The Q-exprs of the file which are code are compiled too, and the code
+ * attached to them, see lispy_native: the lambdas made of them, by \ or
+ * fun, run it in place of their cells. Those are the bodies of the
+ * builtins, see lcc_body, and the Q-exprs given to other functions which
+ * look like code, see lcc_is_code; a list of data is left alone. The code
+ * does what the
+ * evaluator does, the symbols are looked up when they are reached and
+ * the calls go through lval_call, or the special forms are given the
+ * expr; only an `if' with literal branches runs inline, as long as it
+ * is the builtin, and a call on constants is folded, see lispy_fold.
+ */
+typedef struct lcc {
+    lval** syms;   //S[] of the code
+    int nsyms;
+    lval** consts; //C[], the cells of an expr come before it
+    int nconsts;
+    lval** funs;   //the consts with a function
+    int nfuns;
+    FILE* init;    //makes S[] and C[], attaches the functions
+    FILE* code;    //the functions
+    lenv* env;     //the builtins
+    struct lcc_scope* scope; //the frames of the body being compiled
+    int body;      //a body is being compiled, not a top-level form
+} lcc;
 
-    return lval_eval(e, x);
-}
+/*
+ * The frames the code of a body of lcc_body runs in, innermost first:
+ * the symbols each binds, in the order of their slots. A symbol they
+ * don't bind is looked up as a global, so is any symbol of a body the
+ * frames of which aren't known, whose scope is NULL.
+ */
+typedef struct lcc_scope {
+    lval* syms;
+    struct lcc_scope* par;
+} lcc_scope;
 
-lval* buildin_op(lval* v, const char* op)
+static void lcc_line(FILE* f, int ind, const char* fmt, ...)
 {
-    lval* x = NULL;
-
-    for (int i=1; i<v->count; i++)
-    {
-        if (v->cell[i]->type != LVAL_NUM)
-            return lval_err("Function '%s' passed incorrect type, "
-                            "get <%s>, expected<%s>", op,
-                            ltype_name(v->cell[i]->type), ltype_name(LVAL_NUM));
-    }
+    fprintf(f, "%*s", 4*ind, "");
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(f, fmt, va);
+    va_end(va);
+    fputc('\n', f);
+}
 
-    x = lval_num(v->cell[1]->num);
-    for (int i=2; i<v->count; i++)
+/* s as a C string literal */
+static void lcc_cstr(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; s++)
     {
-        lval* y = v->cell[i];
-        if (!strncmp(op, "+", 1))
-            x->num += y->num;
-        else if (!strncmp(op, "-", 1))
-            x->num -= y->num;
-        else if (!strncmp(op, "*", 1))
-            x->num *= y->num;
-        else if (!strncmp(op, "/", 1))
-        {
-            if (y->num == 0)
-            {
-                lval_del(x);
-                x = lval_err("Division by zero!");
-                break;
-            }
-            x->num /= y->num;
-        }
+        if (*s == '"' || *s == '\\' || *s == '?') //no trigraphs
+            fprintf(f, "\\%c", *s);
+        else if (*s >= ' ' && *s <= '~')
+            fputc(*s, f);
+        else
+            fprintf(f, "\\%03o", (unsigned char)*s);
     }
-
-    return x;
+    fputc('"', f);
 }
 
-lval* buildin_add(lenv* e, lval* v)
+static int lcc_find(lval** items, int n, lval* x)
 {
-    return buildin_op(v, "+");
-}
-lval* buildin_sub(lenv* e, lval* v)
-{
-    return buildin_op(v, "-");
-}
-lval* buildin_mul(lenv* e, lval* v)
-{
-    return buildin_op(v, "*");
-}
-lval* buildin_div(lenv* e, lval* v)
-{
-    return buildin_op(v, "/");
+    for (int i=0; i<n; i++)
+        if (items[i] == x)
+            return i;
+    return -1;
 }
 
-lval* buildin_ord(lval* v, const char* op)
+static int lcc_sym(lcc* cc, lval* x)
 {
-    if (v->count != 3)
-        return lval_err("Function %s passed incorrent number of arguments, "
-                        "get %d, expectedd %d", op, 1, v->count-1);
-
-    lval* r = lval_num(0);
-    lval* x = v->cell[1];
-    lval* y = v->cell[2];
-    if (x->type != LVAL_NUM || y->type != LVAL_NUM)
-        return lval_err("Function '%s' passed incorrect type, "
-                        "get <%s> <%s>, expected<%s>", op,
-                        ltype_name(x->type), ltype_name(y->type),
-                        ltype_name(LVAL_NUM));
-    if (!strncmp(op, ">", 1))
-        r->num = x->num > y->num;
-    if (!strncmp(op, "<", 1))
-        r->num = x->num < y->num;
-    if (!strncmp(op, ">=", 2))
-        r->num = x->num >= y->num;
-    if (!strncmp(op, "<=", 2))
-        r->num = x->num <= y->num;
-
-    return r;
-}
+    for (int i=0; i<cc->nsyms; i++)
+        if (!strcmp(cc->syms[i]->sym, x->sym))
+            return i;
 
-lval* buildin_gt(lenv* e, lval* v)
-{
-    return buildin_ord(v, ">");
+    cc->syms = realloc(cc->syms, (cc->nsyms+1) * sizeof(lval*));
+    cc->syms[cc->nsyms] = x;
+    fprintf(cc->init, "    S[%d] = lval_sym(", cc->nsyms);
+    lcc_cstr(cc->init, x->sym);
+    fprintf(cc->init, ");\n");
+    return cc->nsyms++;
 }
 
-lval* buildin_lt(lenv* e, lval* v)
+/* the literal x, made by the init code */
+static int lcc_const(lcc* cc, lval* x)
 {
-    return buildin_ord(v, "<");
-}
+    int k = lcc_find(cc->consts, cc->nconsts, x);
+    if (k >= 0)
+        return k;
 
-lval* buildin_ge(lenv* e, lval* v)
-{
-    return buildin_ord(v, ">=");
-}
+    //the cells first, a line of init is written at once
+    int type = lval_type(x);
+    for (int i=0; (type == LVAL_SEXPR || type == LVAL_QEXPR) && i<x->count; i++)
+    {
+        int t = lval_type(x->cell[i]);
+        if (t == LVAL_SYM)
+            lcc_sym(cc, x->cell[i]);
+        else if (t == LVAL_SEXPR || t == LVAL_QEXPR)
+            lcc_const(cc, x->cell[i]);
+    }
 
-lval* buildin_le(lenv* e, lval* v)
-{
-    return buildin_ord(v, "<=");
-}
+    k = cc->nconsts;
+    cc->consts = realloc(cc->consts, (k+1) * sizeof(lval*));
+    cc->consts[cc->nconsts++] = x;
 
-int lval_equal(lval* x, lval* y)
-{
-    if (x->type != y->type)
-        return 0;
+    FILE* f = cc->init;
+    fprintf(f, "    C[%d] = lispy_const(", k);
+    switch (type)
+    {
+    case LVAL_STR: fprintf(f, "lval_str("); lcc_cstr(f, x->str); fprintf(f, "));\n"); return k;
+    case LVAL_ERR: fprintf(f, "lval_err(\"%%s\", "); lcc_cstr(f, x->err); fprintf(f, "));\n"); return k;
+    case LVAL_SEXPR: fprintf(f, "lval_sexpr());\n"); break;
+    case LVAL_QEXPR: fprintf(f, "lval_qexpr());\n"); break;
+    }
 
-    int r = 0;
-    switch(x->type)
+    for (int i=0; i<x->count; i++)
     {
-    case LVAL_ERR: r = !strcmp(x->err, y->err); break;
-    case LVAL_NUM: r = x->num == y->num; break;
-    case LVAL_SYM: r = !strcmp(x->sym, y->sym); break;
-    case LVAL_FUN:
-        if (x->buildin || y->buildin)
-            r = x->buildin == y->buildin;
-        else
-            r = lval_equal(x->formals, y->formals)
-                && lval_equal(x->body, y->body);
-        break;
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-        if (x->count == y->count)
+        lval* y = x->cell[i];
+        fprintf(f, "    lval_add(C[%d], ", k);
+        switch (lval_type(y))
         {
-            r = !0;
-            for (int i=0; i<x->count; i++)
-            {
-                if (lval_equal(x->cell[i], y->cell[i]) == 0)
-                {
-                    r = 0;
-                    break;
-                }
-            }
+        case LVAL_NUM:
+            if (lval_numval(y) == LONG_MIN)
+                fprintf(f, "lval_num(LONG_MIN)");
+            else
+                fprintf(f, "lval_num(%ldL)", lval_numval(y));
+            break;
+        case LVAL_SYM: fprintf(f, "S[%d]", lcc_sym(cc, y)); break;
+        case LVAL_STR: fprintf(f, "lval_str("); lcc_cstr(f, y->str); fputc(')', f); break;
+        case LVAL_ERR: fprintf(f, "lval_err(\"%%s\", "); lcc_cstr(f, y->err); fputc(')', f); break;
+        default: fprintf(f, "C[%d]", lcc_const(cc, y)); break;
         }
-        break;
+        fprintf(f, ");\n");
     }
-
-    return r;
+    return k;
 }
 
-lval* buildin_cmp(lval* v, char* op)
-{
-    if (v->count != 3)
-        return lval_err("Function %s passed incorrent number of arguments, "
-                        "get %d, expectedd %d", op, 2, v->count-1);
-    int r;
-    if (!strcmp(op, "=="))
-        r = lval_equal(v->cell[1], v->cell[2]);
-    else if (!strcmp(op, "!="))
-        r = !lval_equal(v->cell[1], v->cell[2]);
+static void lcc_expr(lcc* cc, FILE* f, int ind, lval* x, int tail);
+static void lcc_cells(lcc* cc, FILE* f, int ind, lval* v, int tail);
 
-    return lval_num(r);
-}
-
-lval* buildin_eq(lenv* e, lval* v)
+static void lcc_check(FILE* f, int ind)
 {
-    return buildin_cmp(v, "==");
+    lcc_line(f, ind, "if (lval_type(x) == LVAL_ERR) return lispy_leave(sp, x);");
 }
 
-lval* buildin_ne(lenv* e, lval* v)
+/*
+ * Whether the cell i of v is code, when the head of v is the name of the
+ * builtin: 1 for a body run in the env of v, the branches of if, the cond
+ * and body of while and what eval runs, 2 for a body run in a frame which
+ * binds the symbols of the cell 1, those of \, dotimes and loop.
+ */
+static int lcc_body(lval* v, int i)
 {
-    return buildin_cmp(v, "!=");
+    if (lval_type(v->cell[0]) != LVAL_SYM || lval_type(v->cell[i]) != LVAL_QEXPR)
+        return 0;
+    char* f = v->cell[0]->sym;
+    if (!strcmp(f, "if"))
+        return v->count == 4 && i >= 2;
+    if (!strcmp(f, "while"))
+        return v->count == 3;
+    if (!strcmp(f, "eval"))
+        return v->count == 2;
+    if (!strcmp(f, "\\") && v->count == 3 && i == 2)
+        return 2;
+    if (!strcmp(f, "dotimes") && v->count == 4 && i == 3)
+        return 2;
+    if (!strcmp(f, "loop") && v->count >= 3 && i == v->count-1)
+        return 2;
+    return 0;
 }
 
-lval* buildin_if(lenv* e, lval* v)
+/* q given to a function which may run it: a call of a builtin, or of S-exprs */
+static int lcc_is_code(lcc* cc, lval* q)
 {
-    if (v->count-1 != 3)
-        return lval_err("Function 'if' passed incorrent number of arguments, "
-                        "get %d, expectedd %d", 3, v->count-1);
-    if (v->cell[1]->type != LVAL_NUM)
-        return lval_err("Function 'if' passed incorrent type, "
-                        "get %d, expectedd %d",
-                        ltype_name(v->cell[1]->type), ltype_name(LVAL_NUM));
-    if (v->cell[2]->type != LVAL_QEXPR)
-        return lval_err("Function 'if' passed incorrent type, "
-                        "get %d, expectedd %d",
-                        ltype_name(v->cell[2]->type), ltype_name(LVAL_QEXPR));
-    if (v->cell[3]->type != LVAL_QEXPR)
-        return lval_err("Function 'if' passed incorrent type, "
-                        "get %d, expectedd %d",
-                        ltype_name(v->cell[3]->type), ltype_name(LVAL_QEXPR));
-
-    lval* cond = v->cell[1];
-    if (cond->num)
-    {
-        lval* x = lval_copy(v->cell[2]);
-        x->type = LVAL_SEXPR;
-        lval_eval(e, x);
-    }
-    else
+    for (int i=0; i<q->count; i++)
+        if (lval_type(q->cell[i]) == LVAL_SEXPR)
+            return 1;
+    if (!q->count || lval_type(q->cell[0]) != LVAL_SYM)
+        return 0;
+    lval* f = lenv_get(cc->env, q->cell[0]);
+    return lval_type(f) == LVAL_FUN && f->buildin;
+}
+
+/* the function of the body q, run in the frames of scope */
+static void lcc_fun(lcc* cc, lval* q, lcc_scope* scope)
+{
+    int k = lcc_const(cc, q);
+    if (lcc_find(cc->funs, cc->nfuns, q) >= 0)
+        return;
+
+    int id = cc->nfuns;
+    cc->funs = realloc(cc->funs, (id+1) * sizeof(lval*));
+    cc->funs[cc->nfuns++] = q;
+
+    //the functions of the bodies in q are written first
+    char* buf;
+    size_t size;
+    FILE* f = open_memstream(&buf, &size);
+    fprintf(f, "/* the body C[%d] */\n", k);
+    fprintf(f, "static lval* lsp_fun%d(lenv* e, lval* body)\n{\n", id);
+    lcc_line(f, 1, "int sp = lispy_enter(e);");
+    lcc_line(f, 1, "lval* x;");
+    lcc_scope* outer = cc->scope;
+    int body = cc->body;
+    cc->scope = scope;
+    cc->body = 1;
+    lcc_cells(cc, f, 1, q, 1);
+    cc->scope = outer;
+    cc->body = body;
+    lcc_line(f, 1, "return lispy_leave(sp, x);");
+    fprintf(f, "}\n\n");
+    fclose(f);
+    fputs(buf, cc->code);
+    free(buf);
+    fprintf(cc->init, "    lispy_native(C[%d], lsp_fun%d);\n", k, id);
+}
+
+/* the function of the cell i of v, if it is code */
+static void lcc_code(lcc* cc, lval* v, int i)
+{
+    lval* q = v->cell[i];
+    int body = lcc_body(v, i);
+    if (body == 1)
+        lcc_fun(cc, q, cc->scope);
+    else if (body == 2)
     {
-        lval* x = lval_copy(v->cell[3]);
-        x->type = LVAL_SEXPR;
-        return lval_eval(e, x);
+        //a frame which binds the symbols of a list, an error otherwise
+        lval* syms = v->cell[1];
+        int known = lval_type(syms) == LVAL_QEXPR;
+        for (int k=0; known && k<syms->count; k++)
+            known = lval_type(syms->cell[k]) == LVAL_SYM;
+        lcc_scope inner = {syms, cc->scope};
+        lcc_fun(cc, q, known ? &inner : NULL);
     }
+    else if (lval_type(q) == LVAL_QEXPR && lcc_is_code(cc, q))
+        lcc_fun(cc, q, NULL);
 }
 
-/*
- * def {x} 1
- * = {x} 1
- */
-lval* buildin_val(lenv* e, lval* v, int type)
+/* the slot of sym in a frame which binds syms, -1 if it doesn't */
+static int lcc_slot(lval* syms, char* sym)
 {
-    static const char* name_table[] = {
-        "def",
-        "=",
-    };
-    const char* name = name_table[type];
-    lval* syms = v->cell[1];
-
-    if (syms->type != LVAL_QEXPR)
-        return lval_err("Function %s passed incorrect type!", name);
-    if (syms->count == 0 || syms->count != v->count-2)
-        return lval_err("Function %s cannot define incorrect"
-                        "number of values to symbols!", name);
-
+    int slot = 0;
     for (int i=0; i<syms->count; i++)
     {
-        if (syms->cell[i]->type != LVAL_SYM)
-            return lval_err("Function %s passed incorrect type, "
-                            "get <%s>, expected<%s>", name,
-                            ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+        char* s = syms->cell[i]->sym;
+        if (!strcmp(s, sym))
+            return slot;
+        int seen = 0;
+        for (int j=0; j<i && !seen; j++)
+            seen = !strcmp(syms->cell[j]->sym, s);
+        if (!seen)
+            slot++;
     }
-
-    for (int i=0; i<syms->count; i++)
-    {
-        if (type) //global
-            lenv_def(e, syms->cell[i], v->cell[2+i]);
-        else
-            lenv_put(e, syms->cell[i], v->cell[2+i]);
-    }
-
-    return lval_sexpr();
+    return -1;
 }
 
-lval* buildin_def_global(lenv* e, lval* v)
+/*
+ * The builtins with a fast path for two fixnums: the C operator, or
+ * lispy_arith for those which may overflow or fail.
+ */
+static const struct {
+    const char* name;
+    const char* f;
+    const char* op;
+} lcc_prims[] = {
+    {"+", "buildin_add", "+"}, {"-", "buildin_sub", "-"},
+    {"*", "buildin_mul", NULL}, {"/", "buildin_div", NULL},
+    {">", "buildin_gt", ">"}, {"<", "buildin_lt", "<"},
+    {">=", "buildin_ge", ">="}, {"<=", "buildin_le", "<="},
+    {"==", "buildin_eq", "=="}, {"!=", "buildin_ne", "!="},
+};
+
+/* the index in lcc_prims of the builtin v calls, -1 if none */
+static int lcc_is_prim(lval* v)
 {
-    return buildin_val(e, v, 1); //global
+    if (v->count != 3 || lval_type(v->cell[0]) != LVAL_SYM)
+        return -1;
+    for (int i=0; i<(int)(sizeof(lcc_prims)/sizeof(lcc_prims[0])); i++)
+        if (!strcmp(v->cell[0]->sym, lcc_prims[i].name))
+            return i;
+    return -1;
 }
 
-lval* buildin_def_local(lenv* e, lval* v)
+/* the value of the cell i of a call, on the stack when i < last, see lcc_prim */
+static char* lcc_arg(char* buf, int i, int last)
 {
-    return buildin_val(e, v, 0); //local
+    if (i < last)
+        sprintf(buf, "lispy_top(%d)", last-1-i);
+    else
+        sprintf(buf, "a%d", i);
+    return buf;
 }
 
-//note: v is a S-Expr:
-//1. v->cell[0] == "\\"
-//2. v->cell[1] == Q-Expr
-//3. v->cell[2] == Q-Expr
-lval* buildin_lambda(lenv* e, lval* v)
+/*
+ * The call of an arithmetic builtin, inline for two fixnums. Only the
+ * cells before the last S-expr, last, go to the stack: the others are
+ * kept in C locals, the collector doesn't run until the call.
+ */
+static void lcc_prim(lcc* cc, FILE* f, int ind, lval* v, int prim, int tail)
 {
-    if (v->count != 3)
-        return lval_err("Function '\\' passed too many arguments, "
-                        "get %d, expectedd %d", 2, v->count);
-    if (v->cell[1]->type != LVAL_QEXPR)
-        return lval_err("Function '\\' passed incorrect type, "
-                        "get <%s>, expected<%s>",
-                        ltype_name(v->cell[1]->type), ltype_name(LVAL_QEXPR));
-    if (v->cell[2]->type != LVAL_QEXPR)
-        return lval_err("Function '\\' passed incorrect type, "
-                        "get <%s>, expected<%s>",
-                        ltype_name(v->cell[2]->type), ltype_name(LVAL_QEXPR));
-
-    //check formals
-    for (int i=0; i<v->cell[1]->count; i++)
+    lval** c = v->cell;
+    int last = 0;
+    for (int i=1; i<v->count; i++)
+        if (lval_type(c[i]) == LVAL_SEXPR)
+            last = i;
+
+    lcc_expr(cc, f, ind, c[0], 0);
+    lcc_line(f, ind, "if (lval_is_form(x))");
+    lcc_line(f, ind, "{");
+    lcc_line(f, ind+1, "lispy_push(x);");
+    lcc_line(f, ind+1, "x = lispy_form(e, C[%d], %d);", lcc_const(cc, v), tail);
+    lcc_line(f, ind, "}");
+    lcc_line(f, ind, "else");
+    lcc_line(f, ind, "{");
+    for (int i=0; i<v->count; i++)
     {
-        lval*x = v->cell[1]->cell[i];
-        if (x->type != LVAL_SYM)
-            return lval_err("cannot define a non-symbol. "
-                            "get <%s>, expected<%s>",
-                            ltype_name(x->type), ltype_name(LVAL_SYM));
+        if (i)
+            lcc_expr(cc, f, ind+1, c[i], 0);
+        if (i < last)
+            lcc_line(f, ind+1, "lispy_push(x);");
+        else
+            lcc_line(f, ind+1, "lval* a%d = x;", i);
     }
-
-    return lval_lambda(lval_copy(v->cell[1]), lval_copy(v->cell[2]));
+    char a[3][32];
+    for (int i=0; i<3; i++)
+        lcc_arg(a[i], i, last);
+    const char* op = lcc_prims[prim].op;
+    if (op)
+        lcc_line(f, ind+1, "if (!(lispy_is(%s, %s) && lval_is_fixnum(%s) && lval_is_fixnum(%s)))",
+                 a[0], lcc_prims[prim].f, a[1], a[2]);
+    else
+        lcc_line(f, ind+1, "if (!(x = lispy_arith(%s, %s, %s)))", a[0], a[1], a[2]);
+    lcc_line(f, ind+1, "{");
+    for (int i=last; i<v->count; i++)
+        lcc_line(f, ind+2, "lispy_push(a%d);", i);
+    lcc_line(f, ind+2, "x = lispy_apply(e, 3, %d);", tail);
+    lcc_line(f, ind+1, "}");
+    if (op || last)
+    {
+        lcc_line(f, ind+1, "else");
+        lcc_line(f, ind+1, "{");
+        if (op)
+            lcc_line(f, ind+2, "x = lval_num(lval_numval(%s) %s lval_numval(%s));", a[1], op, a[2]);
+        if (last)
+            lcc_line(f, ind+2, "lispy_pop(%d);", last);
+        lcc_line(f, ind+1, "}");
+    }
+    lcc_line(f, ind, "}");
+    if (!tail)
+        lcc_check(f, ind);
 }
 
-/**
- * f= a->cell[0]
- * v: function
- * a: the function arguments
- **/
-lval* lval_call(lenv* e, lval* f, lval* a)
+/* the call of the cells of v, pushed one by one */
+static void lcc_call(lcc* cc, FILE* f, int ind, lval* v, int tail)
 {
-    if (f->buildin) return f->buildin(e, a);
-
-    //lambda
-    if (a->count-1 > f->formals->count)
-        return lval_err("Function passed too many arguments. "
-                        "Got %i, Expected %i.", a->count-1, f->formals->count);
+    lval** c = v->cell;
+    for (int i=1; i<v->count; i++)
+        lcc_code(cc, v, i);
 
-    int i=0;
-    for (; i<a->count-1; i++)
+    if (v->count == 4 && lval_type(c[0]) == LVAL_SYM && !strcmp(c[0]->sym, "if")
+        && lval_type(c[2]) == LVAL_QEXPR && lval_type(c[3]) == LVAL_QEXPR)
     {
-        lval* val = a->cell[1+i];
-        lval* sym = f->formals->cell[i];
-        lenv_put(f->env, sym, val);
+        lcc_expr(cc, f, ind, c[0], 0);
+        lcc_line(f, ind, "lispy_push(x);");
+        lcc_expr(cc, f, ind, c[1], 0);
+        lcc_line(f, ind, "if (lval_type(x) == LVAL_NUM && lispy_is(lispy_top(0), buildin_if))");
+        lcc_line(f, ind, "{");
+        lcc_line(f, ind+1, "lispy_pop(1);");
+        lcc_line(f, ind+1, "if (lval_numval(x))");
+        lcc_line(f, ind+1, "{");
+        lcc_cells(cc, f, ind+2, c[2], tail);
+        lcc_line(f, ind+1, "}");
+        lcc_line(f, ind+1, "else");
+        lcc_line(f, ind+1, "{");
+        lcc_cells(cc, f, ind+2, c[3], tail);
+        lcc_line(f, ind+1, "}");
+        lcc_line(f, ind, "}");
+        lcc_line(f, ind, "else");
+        lcc_line(f, ind, "{");
+        lcc_line(f, ind+1, "lispy_push(x);");
+        for (int i=2; i<4; i++)
+            lcc_line(f, ind+1, "lispy_push(C[%d]);", lcc_const(cc, c[i]));
+        lcc_line(f, ind+1, "x = lispy_apply(e, 4, %d);", tail);
+        if (!tail)
+            lcc_check(f, ind+1);
+        lcc_line(f, ind, "}");
+        return;
     }
-
-    if (i == f->formals->count)
+    int prim = lcc_is_prim(v);
+    if (prim >= 0)
     {
-        f->env->par = e;
-        lval* body = lval_copy(f->body);
-        body->type = LVAL_SEXPR;
-        return lval_eval(f->env, body);
-    } else {
-    //construct
-        lval* x = malloc(sizeof(lval));
-        x->env = lenv_copy(f->env);
-        x->type = f->type;
-        x->buildin = f->buildin;
-
-        //construct the remain formals
-        lval* remain_formals = lval_expr(f->formals->type);
-        for (int k=i; k<f->formals->count; k++)
-        {
-            lval_add(remain_formals, lval_clone(f->formals, k));
-        }
-
-        x->formals = remain_formals;
-        x->body = lval_copy(f->body);
-        return x;
+        lcc_prim(cc, f, ind, v, prim, tail);
+        return;
     }
-}
-
-void lenv_add_buildin(lenv* e, char* name, lbuildin func)
-{
-    lval* k = lval_sym(name);
-    lval* f = lval_buidin(func);
-    lenv_put(e, k, f);
-    lval_del(k);
-    lval_del(f);
-}
 
-lval* buildin_load(lenv* e, lval* v);
-lval* buildin_print(lenv* e, lval* v);
-lval* buildin_error(lenv* e, lval* v);
-void lenv_add_buildins(lenv* e)
-{
-    lenv_add_buildin(e, "list", buildin_list);
-    lenv_add_buildin(e, "head", buildin_head);
-    lenv_add_buildin(e, "tail", buildin_tail);
-    lenv_add_buildin(e, "join", buildin_join);
-    lenv_add_buildin(e, "eval", buildin_eval);
-    lenv_add_buildin(e, "\\",  buildin_lambda);
-    lenv_add_buildin(e, "def",  buildin_def_global);
-    lenv_add_buildin(e, "=",  buildin_def_local);
-
-    lenv_add_buildin(e, ">",  buildin_gt);
-    lenv_add_buildin(e, "<",  buildin_lt);
-    lenv_add_buildin(e, ">=",  buildin_ge);
-    lenv_add_buildin(e, "<=",  buildin_le);
-
-    lenv_add_buildin(e, "==",  buildin_eq);
-    lenv_add_buildin(e, "!=",  buildin_ne);
-
-    lenv_add_buildin(e, "if",  buildin_if);
-
-    lenv_add_buildin(e, "+", buildin_add);
-    lenv_add_buildin(e, "-", buildin_sub);
-    lenv_add_buildin(e, "*", buildin_mul);
-    lenv_add_buildin(e, "/", buildin_div);
-    lenv_add_buildin(e, "load", buildin_load);
-    lenv_add_buildin(e, "print", buildin_print);
-    lenv_add_buildin(e, "error", buildin_error);
-}
-
-void lval_print(lval *v);
-void lval_expr_print(lval *v, char open, char close)
-{
-    putchar(open);
-    for (int i=0; i <v->count; i++)
+    //a special form is given v, see lval_form_arg
+    lcc_expr(cc, f, ind, c[0], 0);
+    lcc_line(f, ind, "lispy_push(x);");
+    lcc_line(f, ind, "if (lval_is_form(x))");
+    lcc_line(f, ind+1, "x = lispy_form(e, C[%d], %d);", lcc_const(cc, v), tail);
+    lcc_line(f, ind, "else");
+    lcc_line(f, ind, "{");
+    for (int i=1; i<v->count; i++)
     {
-        lval_print(v->cell[i]);
-        if (i != v->count-1)
-            putchar(' ');
+        lcc_expr(cc, f, ind+1, c[i], 0);
+        lcc_line(f, ind+1, "lispy_push(x);");
     }
-    putchar(close);
+    lcc_line(f, ind+1, "x = lispy_apply(e, %d, %d);", v->count, tail);
+    lcc_line(f, ind, "}");
+    if (!tail)
+        lcc_check(f, ind);
 }
 
-void lval_str_print(lval* v)
+/* the value of the cells of v as an S-expr */
+static void lcc_cells(lcc* cc, FILE* f, int ind, lval* v, int tail)
 {
-    char* escaped = strdup(v->str);
-    escaped = mpcf_escape(escaped);
-    printf("\"%s\"", escaped);
-    free(escaped);
+    if (!v->count)
+        lcc_line(f, ind, "x = lval_sexpr();");
+    else if (v->count == 1)
+        lcc_expr(cc, f, ind, v->cell[0], tail);
+    else if (cc->body && lval_is_fold(v) && strcmp(v->cell[0]->sym, "if"))
+    {
+        //the call when it doesn't fold
+        lcc_line(f, ind, "if (!(x = lispy_fold(e, C[%d])))", lcc_const(cc, v));
+        lcc_line(f, ind, "{");
+        lcc_call(cc, f, ind+1, v, tail);
+        lcc_line(f, ind, "}");
+    }
+    else
+        lcc_call(cc, f, ind, v, tail);
 }
 
-void lval_print(lval *v)
+/* the value of x, to the variable x */
+static void lcc_expr(lcc* cc, FILE* f, int ind, lval* x, int tail)
 {
-    switch (v->type)
+    switch (lval_type(x))
     {
-    case LVAL_ERR: printf("Error: %s", v->err); break;
-    case LVAL_NUM: printf("%ld", v->num); break;
-    case LVAL_SYM: printf("%s", v->sym); break;
-    case LVAL_STR: lval_str_print(v); break;
-    case LVAL_FUN:
-        if (v->buildin)
-        {
-            printf("<buildin: %p>", v->buildin);
-        }
+    case LVAL_NUM:
+        if (lval_numval(x) == LONG_MIN)
+            lcc_line(f, ind, "x = lval_num(LONG_MIN);");
         else
-        {
-            printf("(\\ ");
-            lval_print(v->formals);
-            putchar(' ');
-            lval_print(v->body);
-            putchar(')');
-        }
+            lcc_line(f, ind, "x = lval_num(%ldL);", lval_numval(x));
+        break;
+    case LVAL_SYM:
+    {
+        //a formal of the frames around, by its address
+        int depth = 0, slot = -1;
+        lcc_scope* p = cc->scope;
+        for (; p && (slot = lcc_slot(p->syms, x->sym)) < 0; p = p->par)
+            depth++;
+        if (p)
+            lcc_line(f, ind, "x = lispy_local(e, S[%d], %d, %d);", lcc_sym(cc, x), depth, slot);
+        else
+            lcc_line(f, ind, "x = lispy_global(e, S[%d]);", lcc_sym(cc, x));
+        lcc_check(f, ind);
+        break;
+    }
+    case LVAL_SEXPR:
+        lcc_cells(cc, f, ind, x, tail);
+        break;
+    default:
+        lcc_line(f, ind, "x = C[%d];", lcc_const(cc, x));
+        if (lval_type(x) == LVAL_ERR)
+            lcc_check(f, ind);
         break;
-    case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
     }
 }
 
-void lval_println(lval *v)
+/*
+ * The name of the entry of the code of src, lsp_<name>_load, from its
+ * file name without the directory and the extension.
+ */
+static char* lcc_entry(const char* src)
 {
-    lval_print(v);
-    putchar('\n');
+    const char* base = strrchr(src, '/') ? strrchr(src, '/')+1 : src;
+    size_t n = strcspn(base, ".");
+    char* name = malloc(n + 10);
+    sprintf(name, "lsp_%.*s_load", (int)n, base);
+    for (char* c = name+4; *c; c++)
+        if (!(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z')
+            && !(*c >= '0' && *c <= '9'))
+            *c = '_';
+    return name;
 }
 
-lval* buildin_print(lenv* e, lval* v)
+/*
+ * Compile the forms of the file src to the C file out, stdout if NULL.
+ * The code runs the forms from its entry, see lcc_entry, which main calls
+ * unless lib is set: the entry is then called by the program out is
+ * linked into, at the top level, with the env of lispy_init.
+ */
+static int lcc_file(const char* src, const char* out, int lib)
 {
-    for (int i=1; i<v->count; i++)
+    lenv* env = lispy_reader();
+    lval* forms = lispy_read_file(src);
+    if (lval_type(forms) == LVAL_ERR)
     {
-        lval_print(v->cell[i]);
-        putchar(' ');
+        fprintf(stderr, "%s: %s\n", src, forms->err);
+        return 1;
     }
-    putchar('\n');
-
-    return lval_sexpr();
-}
-
-lval* buildin_error(lenv* e, lval* v)
-{
-    if (v->count != 2)
-        return lval_err("Function 'error' passed too many arguments, "
-                        "get %d, expectedd %d", 1, v->count);
-    if (v->cell[1]->type != LVAL_STR)
-        return lval_err("Function 'error' passed incorrect type, "
-                        "get <%s>, expected<%s>",
-                        ltype_name(v->cell[1]->type), ltype_name(LVAL_STR));
-
-    return lval_err(v->cell[1]->str);
-}
-
-lval* lval_eval_sexpr(lenv* e, lval* v)
-{
-    lval* result = NULL;
-    for (int i=0; i<v->count; i++)
+    lispy_const(forms);
+
+    lcc cc = {0};
+    cc.env = env;
+    char *init, *code;
+    size_t init_size, code_size;
+    FILE* f = open_memstream(&code, &code_size);
+    cc.init = open_memstream(&init, &init_size);
+    cc.code = f;
+    for (int i=0; i<forms->count; i++)
     {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-        //error checking
-        if (v->cell[i]->type == LVAL_ERR)
-        {
-            result = lval_err(v->cell[i]->err);
-            goto out;
-        }
+        //the functions of the form go to code first
+        char* buf;
+        size_t size;
+        FILE* g = open_memstream(&buf, &size);
+        fprintf(g, "static lval* lsp_form%d(lenv* e, lval* v)\n{\n", i);
+        lcc_line(g, 1, "int sp = lispy_enter(e);");
+        lcc_line(g, 1, "lval* x;");
+        lcc_expr(&cc, g, 1, forms->cell[i], 0);
+        lcc_line(g, 1, "return lispy_leave(sp, x);");
+        fprintf(g, "}\n\n");
+        fclose(g);
+        fputs(buf, f);
+        free(buf);
     }
+    fclose(f);
+    fclose(cc.init);
 
-    if (v->count == 0)
-        return v;
-    if (v->count == 1)
+    FILE* o = out ? fopen(out, "w") : stdout;
+    if (!o)
     {
-        result = v->cell[0];
-        free(v);
-        return result;
+        perror(out);
+        return 1;
     }
-
-    //get the first child of S-expr, it should be a `symbol'
-    lval* f = v->cell[0];
-    if (f->type != LVAL_FUN)
+    char* entry = lcc_entry(src);
+    if (lib)
+        fprintf(o, "/*\n * Compiled from %s by --compile --lib, build with the runtime\n"
+                   " *     cc -std=c99 -c %s -I.\n"
+                   " * and call %s(lispy_init()) to run it\n */\n",
+                src, out ? out : "out.c", entry);
+    else
+        fprintf(o, "/*\n * Compiled from %s by --compile, build with\n"
+                   " *     cc -std=c99 %s lispy.c -I. -lm\n */\n",
+                src, out ? out : "out.c");
+    fprintf(o, "#include <stdio.h>\n#include \"lispy.h\"\n\n");
+    fprintf(o, "static lval* S[%d];\nstatic lval* C[%d];\n\n",
+            cc.nsyms ? cc.nsyms : 1, cc.nconsts ? cc.nconsts : 1);
+    fputs(code, o);
+    fprintf(o, "static void lsp_init(void)\n{\n%s}\n\n", init);
+
+    fprintf(o, "/* run the forms of %s in e */\n", src);
+    fprintf(o, "void %s(lenv* e)\n{\n", entry);
+    lcc_line(o, 1, "static int init;");
+    lcc_line(o, 1, "if (!init)");
+    lcc_line(o, 2, "lsp_init();");
+    lcc_line(o, 1, "init = 1;");
+    for (int i=0; i<forms->count; i++)
+        lcc_line(o, 1, "lispy_run(e, lsp_form%d);", i);
+    fprintf(o, "}\n");
+
+    if (!lib)
     {
-        result = lval_err("first emlempent is not a function!");
-        goto out;
+        fprintf(o, "\nint main(int argc, char* argv[])\n{\n");
+        lcc_line(o, 1, "for (int i=1; i<argc; i++)");
+        lcc_line(o, 1, "{");
+        lcc_line(o, 2, "if (!lispy_option(argv[i]))");
+        lcc_line(o, 2, "{");
+        lcc_line(o, 3, "fprintf(stderr, \"usage: %%s [--gc=incremental|stop-the-world] \"");
+        lcc_line(o, 3, "        \"[--gc-budget=<us>] [--vm] [--jit]\\n\", argv[0]);");
+        lcc_line(o, 3, "return 1;");
+        lcc_line(o, 2, "}");
+        lcc_line(o, 1, "}");
+        fputc('\n', o);
+        lcc_line(o, 1, "%s(lispy_init());", entry);
+        lcc_line(o, 1, "return 0;");
+        fprintf(o, "}\n");
     }
-
-    result = lval_call(e, f, v);
-
-out:
-    lval_del(v);
-    return result;
-}
-
-lval* lval_eval(lenv* e, lval* v)
-{
-    if (v->type == LVAL_SYM)
-        return lenv_get(e, v);
-    else if (v->type == LVAL_SEXPR)
-        return lval_eval_sexpr(e, v);
-
-    return v;
+    if (out)
+        fclose(o);
+
+    free(entry);
+    free(init);
+    free(code);
+    free(cc.syms);
+    free(cc.consts);
+    free(cc.funs);
+    return 0;
 }
 
-lval* buildin_load(lenv* e, lval* v)
+int main(int argc, char* argv[])
 {
-    mpc_result_t r;
-    if (v->count != 2)
-        return lval_err("Function 'load' passed too many arguments, "
-                        "get %d, expectedd %d", 1, v->count);
-    if (v->cell[1]->type != LVAL_STR)
-        return lval_err("Function 'load' passed incorrect type, "
-                        "get <%s>, expected<%s>",
-                        ltype_name(v->cell[1]->type), ltype_name(LVAL_STR));
-    const char* filename = v->cell[1]->str;
-    if (mpc_parse_contents(filename, Lispy, &r))
+    const char* src = NULL;
+    const char* out = NULL;
+    const char* script = NULL;
+    int lib = 0;
+    for (int i=1; i<argc; i++)
     {
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
-        for (int i=0; i<expr->count; i++)
+        if (lispy_option(argv[i]))
+            continue;
+        else if (!strcmp(argv[i], "--compile") && i+1 < argc)
+            src = argv[++i];
+        else if (!strcmp(argv[i], "--lib"))
+            lib = 1;
+        else if (!strcmp(argv[i], "-o") && i+1 < argc)
+            out = argv[++i];
+        else if (argv[i][0] != '-' && !script)
+            script = argv[i];
+        else
         {
-            /* NOTE: expr->cell[i] will be freed in lval_eval!! */
-            lval* x = lval_eval(e, expr->cell[i]);
-            //if (x->type == LVAL_ERR)
-            lval_println(x);
-
-            lval_del(x);
+            fprintf(stderr, "usage: %s [--gc=incremental|stop-the-world] "
+                    "[--gc-budget=<us>] [--vm] [--jit] "
+                    "[--compile <file> [--lib] [-o <out.c>] | <file>]\n", argv[0]);
+            return 1;
         }
-
-        free(expr);
-
-        return lval_sexpr();
-    } else {
-        //mpc_err_print(r.error);
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
-        lval* err = lval_err("Could not load Library %s", err_msg);
-        free(err_msg);
-        return err;
     }
-}
-
 
-int main(int argc, char* argv[])
-{
-    printf("version: 0.0.1\n");
-
-    mpc_parser_t* Number = mpc_new("number");
-    mpc_parser_t* Symbol = mpc_new("symbol");
-    mpc_parser_t* String = mpc_new("string");
-    mpc_parser_t* Comment = mpc_new("comment");
-    mpc_parser_t* Sexpr = mpc_new("sexpr");
-    mpc_parser_t* Qexpr = mpc_new("qexpr");
-    mpc_parser_t* Expr = mpc_new("expr");
-    Lispy = mpc_new("lispy");
-
-    mpca_lang(MPCA_LANG_DEFAULT,                                      \
-        "                                                             \
-            number   : /-?[0-9]+/ ;                                   \
-            symbol   : /[a-zA-Z_0-9+\\-*\\/\\\\=<>!&]+/ ;             \
-            string   : /\"(\\\\.|[^\"])*\"/ ;                         \
-            comment  : /;[^\\r\\n]*/ ;                                 \
-            sexpr    : '(' <expr>* ')' ;                              \
-            qexpr    : '{' <expr>* '}' ;                              \
-            expr     : <number>  | <symbol> | <string> |              \
-                       <comment> | <sexpr>  | <qexpr> ;                           \
-            lispy    : /^/ <expr>* /$/ ;                              \
-        ",                                                            \
-        Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    if (src)
+        return lcc_file(src, out, lib);
 
-    lenv *e = lenv_new();
-    lenv_add_buildins(e);
-    while (1)
+    //run a file instead of the REPL, as load does
+    if (script)
     {
-        char* line = readline("lispy> ");
-        add_history(line);
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", line, Lispy, &r))
+        lval* x = lispy_load(lispy_reader(), script);
+        if (lval_type(x) == LVAL_ERR)
         {
-            mpc_ast_print(r.output);
-            lval* x = lval_eval(e, lval_read(r.output));
             lval_println(x);
-            lval_del(x);
-            mpc_ast_delete(r.output);
-        } else {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            return 1;
         }
-
-        free(line);
+        return 0;
     }
 
-    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    printf("version: 0.0.1\n");
+    lispy_repl(lispy_reader());
     return 0;
 }
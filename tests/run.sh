@@ -0,0 +1,66 @@
+#!/bin/sh
+# Runs the scripts given, or every tests/*.lspy, with the tree-walker,
+# --vm, --jit, the incremental collector in its smallest steps, so that
+# the marking spans many of them, compiled by --compile and by --compile
+# --lib into a program of its own, and compares the output with the .out
+# next to it. Run from the top of the tree, by `make test'. Each runs with
+# a C stack of STACK kilobytes: the recursion of the scripts goes to the
+# heap, and that of the native calls must stay within it.
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--g -std=c99}
+HELLO=${HELLO:-./hello}
+STACK=${STACK:-1024}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# the runtime of the compiled scripts, built once, without mpc and readline
+$CC $CFLAGS -I. -c lispy.c -o "$tmp/lispy.o" || exit 1
+
+fail=0
+check()
+{
+    if diff -u "$1" "$tmp/got" > "$tmp/diff"; then
+        :
+    else
+        echo "FAIL: $2"
+        cat "$tmp/diff"
+        fail=1
+    fi
+}
+
+[ $# = 0 ] && set -- tests/*.lspy
+for t in "$@"; do
+    want=${t%.lspy}.out
+    for mode in "" --vm --jit "--gc=incremental --gc-budget=0"; do
+        (ulimit -s $STACK; exec $HELLO $mode "$t") > "$tmp/got" 2>&1
+        check "$want" "$t ${mode:-(tree-walker)}"
+    done
+
+    if $HELLO --compile "$t" -o "$tmp/prog.c" &&
+       $CC $CFLAGS -I. "$tmp/prog.c" "$tmp/lispy.o" -lm -o "$tmp/prog"; then
+        (ulimit -s $STACK; exec "$tmp/prog") > "$tmp/got" 2>&1
+    else
+        echo "compile failed" > "$tmp/got"
+    fi
+    check "$want" "$t --compile"
+
+    name=$(basename "$t" .lspy)
+    cat > "$tmp/host.c" <<EOF
+#include "lispy.h"
+void lsp_${name}_load(lenv* e);
+int main(void) { lsp_${name}_load(lispy_init()); return 0; }
+EOF
+    if $HELLO --compile "$t" --lib -o "$tmp/lib.c" &&
+       $CC $CFLAGS -I. -c "$tmp/lib.c" -o "$tmp/lib.o" &&
+       $CC $CFLAGS -I. "$tmp/host.c" "$tmp/lib.o" "$tmp/lispy.o" -lm -o "$tmp/host"; then
+        (ulimit -s $STACK; exec "$tmp/host") > "$tmp/got" 2>&1
+    else
+        echo "compile failed" > "$tmp/got"
+    fi
+    check "$want" "$t --compile --lib"
+done
+
+[ $fail = 0 ] && echo "all tests passed"
+exit $fail